@@ -0,0 +1,152 @@
+/*
+ * y64run: assemble y64 programs and run them in one process, with no .bin
+ * files in between, i.e., 'y64asm foo.ys; y64sim foo.bin > foo.sim' for
+ * each program but in memory
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "y64sim.h"
+#include "../lab5/y64lib.h"
+
+#define err_print(_s, _a ...) \
+    fprintf(stderr, _s"\n", _a);
+
+static bool_t screen = FALSE;  /* print the reports to screen instead of .sim */
+static int asm_flags = 0;
+
+/*
+ * run_file: assemble 'fname' (a .ys file), run it and write its report
+ *
+ * return
+ *     0: success
+ *     -1: error
+ */
+static int run_file(y64sim_t *sim, char *fname, int max_steps)
+{
+    struct stat st;
+    char *src;
+    unsigned char *bin;
+    size_t binlen;
+    y64asm_t *as;
+    char simfname[512];
+    FILE *out = stdout;
+    int fd, ret = -1;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        err_print("Can't open input file '%s'", fname);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    src = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (src == MAP_FAILED) {
+        err_print("Can't map input file '%s'", fname);
+        return -1;
+    }
+
+    /* assemble into memory */
+    as = y64asm_new();
+    if (as == NULL || y64asm_assemble(as, src, st.st_size, asm_flags) < 0 ||
+        (bin = y64asm_binary(as, &binlen)) == NULL) {
+        err_print("Failed to assemble '%s'", fname);
+        goto out;
+    }
+
+    /* load the image into a clean simulator */
+    sim->pc = 0;
+    sim->cc = DEFAULT_CC;
+    memset(sim->r->data, 0, sim->r->len);
+    if (load_binbuf(sim->m, bin, binlen) < 0) {
+        err_print("Failed to load binary of '%s'", fname);
+        free(bin);
+        goto out;
+    }
+    free(bin);
+
+    if (!screen) {
+        int rootlen = strlen(fname) - 3;
+        memcpy(simfname, fname, rootlen);
+        strcpy(simfname + rootlen, ".sim");
+        out = fopen(simfname, "w");
+        if (!out) {
+            err_print("Can't open output file '%s'", simfname);
+            goto out;
+        }
+    }
+    run_y64sim(sim, max_steps, out);
+    if (!screen)
+        fclose(out);
+    ret = 0;
+
+out:
+    y64asm_free(as);
+    if (st.st_size)
+        munmap(src, st.st_size);
+    return ret;
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [-v] [-O] [-n max_steps] file.ys ...\n", pname);
+    printf("   -v print the reports to screen instead of file.sim\n");
+    printf("   -O optimize the code with peephole rules (like y64asm -O)\n");
+    printf("   -n max steps of each program (default %d)\n", MAX_STEP);
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_steps = MAX_STEP;
+    int nextarg = 1;
+    int i, nerr = 0;
+    y64sim_t *sim;
+
+    while (nextarg < argc && argv[nextarg][0] == '-') {
+        char flag = argv[nextarg][1];
+        switch (flag) {
+          case 'v':
+            screen = TRUE;
+            nextarg++;
+            break;
+          case 'O':
+            asm_flags |= Y64ASM_OPTIMIZE;
+            nextarg++;
+            break;
+          case 'n':
+            if (nextarg + 1 >= argc)
+                usage(argv[0]);
+            max_steps = atoi(argv[nextarg+1]);
+            nextarg += 2;
+            break;
+          default:
+            usage(argv[0]);
+        }
+    }
+    if (nextarg >= argc)
+        usage(argv[0]);
+
+    /* only support *.ys files */
+    for (i = nextarg; i < argc; i++) {
+        int len = strlen(argv[i]);
+        if (len < 4 || len > 500 || strcmp(argv[i] + len - 3, ".ys"))
+            usage(argv[0]);
+    }
+
+    /* one simulator for all programs, reset before each run */
+    sim = new_y64sim(MEM_SIZE);
+    for (i = nextarg; i < argc; i++)
+        if (run_file(sim, argv[i], max_steps) < 0)
+            nerr++;
+    free_y64sim(sim);
+
+    return nerr ? 1 : 0;
+}
@@ -5,11 +5,12 @@
 
 #include "y64sim.h"
 
-#define err_print(_s, _a ...) \
-    fprintf(stdout, _s"\n", _a);
+/* where the report (and errors of a run) go, stdout if not set */
+static FILE *sim_out = NULL;
 
+#define err_print(_s, _a ...) \
+    fprintf(sim_out ? sim_out : stdout, _s"\n", _a);
 
-typedef enum {STAT_AOK, STAT_HLT, STAT_ADR, STAT_INS} stat_t;
 
 char *stat_names[] = { "AOK", "HLT", "ADR", "INS" };
 
@@ -234,6 +235,18 @@ int load_binfile(mem_t *m, FILE *f)
     return 0;
 }
 
+/* load binary code and data from a buffer (e.g., from y64asm_binary) */
+int load_binbuf(mem_t *m, byte_t *bin, size_t len)
+{
+    if (len > (size_t)m->len) {
+        err_print("too large memory footprint (0x%x)", m->len);
+        return -1;
+    }
+    memcpy(m->data, bin, len);
+    memset(m->data + len, 0, m->len - len);
+    return 0;
+}
+
 /*
  * compute_alu: do ALU operations 
  * args
@@ -360,9 +373,9 @@ stat_t nexti(y64sim_t *sim)
     itype_t icode;
     alu_t ifun;
     long_t next_pc = sim->pc;
-    regid_t rega, regb;
+    regid_t rega = REG_NONE, regb = REG_NONE;
     byte_t nextb;
-    long_t nextv, imm;
+    long_t nextv, imm = 0;
     
     /* get code and function （1 byte) */
     if (!get_byte_val(sim->m, next_pc, &codefun)) {
@@ -517,6 +530,51 @@ stat_t nexti(y64sim_t *sim)
     return STAT_AOK;
 }
 
+/*
+ * run_y64sim: run the loaded image step-by-step, and print its final stat
+ * and the changes to registers and memory (the .sim report) to 'out'
+ * args
+ *     sim: the simulator with loaded image
+ *     max_steps: max number of instructions to execute
+ *     out: where the report goes
+ *
+ * return
+ *     the final stat
+ */
+stat_t run_y64sim(y64sim_t *sim, int max_steps, FILE *out)
+{
+    mem_t *saver, *savem;
+    int step = 0;
+    stat_t e = STAT_AOK;
+
+    sim_out = out;
+
+    /* save initial register and memory stat */
+    saver = dup_reg(sim->r);
+    savem = dup_mem(sim->m);
+
+    /* execute binary code step-by-step */
+    for (step = 0; step < max_steps && e == STAT_AOK; step++)
+        e = nexti(sim);
+
+    /* print final stat of y64sim */
+    fprintf(out, "Stopped in %d steps at PC = 0x%lx.  Status '%s', CC %s\n",
+            step, sim->pc, stat_name(e), cc_name(sim->cc));
+
+    fprintf(out, "Changes to registers:\n");
+    diff_reg(saver, sim->r, out);
+
+    fprintf(out, "\nChanges to memory:\n");
+    diff_mem(savem, sim->m, out);
+
+    free_reg(saver);
+    free_mem(savem);
+    sim_out = NULL;
+    return e;
+}
+
+#ifndef Y64SIM_LIB
+
 void usage(char *pname)
 {
     printf("Usage: %s file.bin [max_steps]\n", pname);
@@ -528,9 +586,6 @@ int main(int argc, char *argv[])
     FILE *binfile;
     int max_steps = MAX_STEP;
     y64sim_t *sim;
-    mem_t *saver, *savem;
-    int step = 0;
-    stat_t e = STAT_AOK;
 
     if (argc < 2 || argc > 3)
         usage(argv[0]);
@@ -557,29 +612,13 @@ int main(int argc, char *argv[])
     }
     fclose(binfile);
 
-    /* save initial register and memory stat */
-    saver = dup_reg(sim->r);
-    savem = dup_mem(sim->m);
-
-    /* execute binary code step-by-step */
-    for (step = 0; step < max_steps && e == STAT_AOK; step++)
-        e = nexti(sim);
-
-    /* print final stat of y64sim */
-    printf("Stopped in %d steps at PC = 0x%lx.  Status '%s', CC %s\n",
-            step, sim->pc, stat_name(e), cc_name(sim->cc));
-
-    printf("Changes to registers:\n");
-    diff_reg(saver, sim->r, stdout);
-
-    printf("\nChanges to memory:\n");
-    diff_mem(savem, sim->m, stdout);
+    /* run and print the report */
+    run_y64sim(sim, max_steps, stdout);
 
     free_y64sim(sim);
-    free_reg(saver);
-    free_mem(savem);
-
     return 0;
 }
 
+#endif /* Y64SIM_LIB */
+
 ;
\ No newline at end of file
@@ -79,5 +79,17 @@ typedef struct y64sim {
     cc_t cc;
 } y64sim_t;
 
+typedef enum {STAT_AOK, STAT_HLT, STAT_ADR, STAT_INS} stat_t;
+
+/*
+ * simulator library (y64sim.c built with -DY64SIM_LIB leaves out main),
+ * e.g., for y64run to run images assembled in memory
+ */
+y64sim_t *new_y64sim(int slen);
+void free_y64sim(y64sim_t *sim);
+int load_binfile(mem_t *m, FILE *f);
+int load_binbuf(mem_t *m, byte_t *bin, size_t len);
+stat_t run_y64sim(y64sim_t *sim, int max_steps, FILE *out);
+
 #endif
 
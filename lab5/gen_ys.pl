@@ -0,0 +1,97 @@
+#!/usr/bin/perl
+
+# gen_ys.pl: generate a synthetic y64 assembly file to benchmark y64asm
+#
+# usage: gen_ys.pl [out.ys] [lines] [label_every] [fwd_percent] [dir_every]
+#     lines: number of code lines (instructions and directives)
+#     label_every: one label per that many lines
+#     fwd_percent: percent of jumps and calls to a label defined later
+#     dir_every: one data directive (or .align) per that many lines
+
+$out_filename = $ARGV[0];
+$out_filename = "bench.ys" unless $out_filename;
+$num_lines = $ARGV[1];
+$num_lines = 10000 unless $num_lines;
+$label_every = $ARGV[2];
+$label_every = 8 unless $label_every;
+$fwd_percent = $ARGV[3];
+$fwd_percent = 50 unless defined $fwd_percent;
+$dir_every = $ARGV[4];
+$dir_every = 16 unless $dir_every;
+
+@regs = ("%rax", "%rcx", "%rdx", "%rbx", "%rsi", "%rdi",
+         "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14");
+@ops = ("addq", "subq", "andq", "xorq");
+@jmps = ("jmp", "jle", "jl", "je", "jne", "jge", "jg", "call");
+@movs = ("rrmovq", "cmovle", "cmovl", "cmove", "cmovne", "cmovge", "cmovg");
+
+# labels defined: one at line 0 and every label_every lines after it
+$num_labels = int(($num_lines + $label_every - 1) / $label_every);
+srand(1);
+
+sub reg { return $regs[int(rand @regs)]; }
+
+# a label already defined, or (fwd_percent of the time) one defined
+# later; $cur labels are defined, so only branch forward if one is left
+# after L$cur
+sub target {
+    my ($cur) = @_;
+    if ($cur < $num_labels - 1 && ($cur == 0 || (rand 100) < $fwd_percent)) {
+        return "L" . ($cur + 1 + int(rand ($num_labels - $cur - 1)));
+    }
+    return "L" . int(rand $cur);
+}
+
+open OUT, ">$out_filename" or die "Can't open $out_filename\n";
+print OUT "# synthetic y64 code: $num_lines lines, $num_labels labels\n";
+print OUT "    .pos 0\n";
+print OUT "    irmovq stack, %rsp\n";
+
+$label = 0;
+for ($i = 0; $i < $num_lines; $i++) {
+    if ($i % $label_every == 0) {
+        print OUT "L$label:\n";
+        $label++;
+    }
+    if ($i % $dir_every == $dir_every - 1) {
+        $k = int(rand 4);
+        if ($k == 0) {
+            print OUT "    .align 8\n";
+        } elsif ($k == 1) {
+            print OUT "    .quad " . target($label) . "\n";
+        } else {
+            printf OUT "    .quad 0x%x\n", int(rand 65536);
+        }
+        next;
+    }
+    $k = int(rand 8);
+    if ($k == 0) {
+        printf OUT "    irmovq \$%d, %s\n", int(rand 4096), reg();
+    } elsif ($k == 1) {
+        print OUT "    irmovq " . target($label) . ", " . reg() . "\n";
+    } elsif ($k == 2) {
+        printf OUT "    mrmovq %d(%s), %s\n", 8 * int(rand 64), reg(), reg();
+    } elsif ($k == 3) {
+        printf OUT "    rmmovq %s, %d(%s)\n", reg(), 8 * int(rand 64), reg();
+    } elsif ($k == 4) {
+        print OUT "    " . $jmps[int(rand @jmps)] . " " . target($label) . "\n";
+    } elsif ($k == 5) {
+        print OUT "    " . $movs[int(rand @movs)] . " " . reg() . ", " . reg() . "\n";
+    } elsif ($k == 6) {
+        print OUT "    " . $ops[int(rand @ops)] . " " . reg() . ", " . reg() . "  # op\n";
+    } else {
+        print OUT "    pushq " . reg() . "\n";
+        print OUT "    popq " . reg() . "\n";
+        $i++;
+    }
+}
+
+# every label referenced must be defined
+for (; $label < $num_labels; $label++) {
+    print OUT "L$label:\n";
+}
+print OUT "    halt\n";
+print OUT "    .align 8\n";
+print OUT "    .pos " . sprintf("0x%x", 0x100000 + 16 * $num_lines) . "\n";
+print OUT "stack:\n";
+close OUT;
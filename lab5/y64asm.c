@@ -1,23 +1,161 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "y64asm.h"
 
-line_t *line_head = NULL;
-line_t *line_tail = NULL;
-int lineno = 0;
+typedef enum { PP_NONE, PP_MACRO, PP_REPT, PP_ENDM, PP_ENDR,
+    PP_SET } ppdir_t;
+
+/* hash index of preprocessor names (constants or macros), see pphash_slot */
+typedef struct {
+    const char *name;           /* NULL if the slot is empty */
+    int len;
+    void *item;
+} ppslot_t;
+
+typedef struct {
+    ppslot_t *slot;
+    unsigned long size;         /* number of slots, 0 or a power of 2 */
+    unsigned long used;
+} pphash_t;
+
+/* a source line of incremental reassembly (y64asm -i) */
+typedef struct incr_line {
+    cache_line_t rec;
+    char *label;    /* label defined on the line, or NULL */
+    char *relname;  /* symbol relocated on the line, or NULL */
+    line_t *line;   /* the line of current source */
+    bool_t dirty;   /* re-encoded or re-relocated in this run */
+} incr_line_t;
+
+/*
+ * assembler context: all the state of one assembly, so assemblies in
+ * different threads don't share anything (see y64asm_new)
+ */
+struct y64asm {
+    line_t *line_head;
+    line_t *line_tail;
+    int lineno;
+    int64_t vmaddr;             /* vm addr */
+
+    chunk_t *arena;
+
+    /* source buffer: mmapped input file (or a copy of the caller's buffer) */
+    char *src_buf;
+    size_t src_len;
+    size_t src_maplen;          /* 0 if 'src_buf' is malloced */
+
+    symbol_t *symtab;
+    symbol_t *symtab_tail;
+    symbol_t **symhash;
+    unsigned long symhash_size; /* number of slots, always power of 2 */
+    unsigned long symhash_used; /* number of occupied slots */
+
+    reloc_t *reltab;
+    reloc_t *reltab_tail;
+    global_t *globals;          /* names given to .global */
+
+    /* preprocessor */
+    pphash_t consthash;         /* constant_t by name */
+    pphash_t macrohash;         /* macro_t by name */
+    int pp_serial;              /* value of '\@', one per expansion */
+    ppdir_t pp_kind;            /* the block being recorded */
+    int pp_nest;                /* blocks opened inside it */
+    int pp_start;               /* line of its .macro/.rept */
+    long pp_count;              /* .rept count */
+    macro_t *pp_macro;          /* .macro being defined */
+    ppline_t *pp_body;
+    ppline_t *pp_body_tail;
+
+    bool_t relocatable;         /* leave unknown symbols to y64ld */
+    bool_t optimize;            /* run the peephole optimizer */
+
+    /* incremental reassembly, see assemble_incr */
+    bool_t incremental;
+    byte_t *cache_buf;          /* the mapped cache file of last run */
+    size_t cache_len;
+    cache_header_t cache_hdr;   /* its header, zero if there is none */
+    cache_line_t **old_lines;
+    uint32_t old_nlines;
+    incr_line_t *new_lines;
+    uint32_t new_nlines;
+    bool_t same_layout;         /* every line kept its address and size */
+
+    /* listing */
+    char *list_buf;
+    size_t list_used;
+    int list_fd;                /* fd of listing, or -1 if not emitted by binfile */
+    bool_t list_done;
+};
+
+/* the context of the running assembly in this thread */
+static __thread y64asm_t *as = NULL;
 
 #define err_print(_s, _a ...) do { \
-  if (lineno < 0) \
+  if (as == NULL || as->lineno < 0) \
     fprintf(stderr, "[--]: "_s"\n", ## _a); \
   else \
-    fprintf(stderr, "[L%d]: "_s"\n", lineno, ## _a); \
+    fprintf(stderr, "[L%d]: "_s"\n", as->lineno, ## _a); \
 } while (0);
 
+/* arena (freed all at once in y64asm_free) */
+#define ARENA_CHUNK (64 * 1024)
+
+
+/*
+ * arena_alloc: carve 'size' zeroed bytes out of the arena,
+ * chunks are never freed individually, only all at once in arena_free
+ */
+void *arena_alloc(size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    if (as->arena == NULL || as->arena->used + size > as->arena->size) {
+        /* grow geometrically so large inputs need few chunks */
+        size_t csize = as->arena ? as->arena->size * 2 : ARENA_CHUNK;
+        while (csize < size)
+            csize *= 2;
+        chunk_t *c = (chunk_t *)calloc(1, sizeof(chunk_t) + csize);
+        if (c == NULL) {
+            fprintf(stderr, "[--]: Out of memory\n");
+            exit(1);
+        }
+        c->size = csize;
+        c->next = as->arena;
+        as->arena = c;
+    }
+    void *p = as->arena->data + as->arena->used;
+    as->arena->used += size;
+    return p;
+}
+
+/* arena_strndup: copy 'len' bytes of 's' into the arena as a string */
+char *arena_strndup(const char *s, size_t len)
+{
+    char *d = (char *)arena_alloc(len + 1);
+    memcpy(d, s, len);
+    d[len] = '\0';
+    return d;
+}
 
-int64_t vmaddr = 0;    /* vm addr */
+void arena_free(void)
+{
+    chunk_t *c;
+    while ((c = as->arena) != NULL) {
+        as->arena = c->next;
+        free(c);
+    }
+}
 
 /* register table */
 const reg_t reg_table[REG_NONE] = {
@@ -37,15 +175,59 @@ const reg_t reg_table[REG_NONE] = {
     {"%r13", REG_R13, 4},
     {"%r14", REG_R14, 4}
 };
-const reg_t* find_register(char *name)
+/*
+ * find_register: match a register name span (e.g., '%r10') by dispatching
+ * on its third char instead of comparing against every table entry
+ */
+const reg_t* find_register(const char *name, int len)
 {
-    int i;
-    for (i = 0; i < REG_NONE; i++)
-        if (!strncmp(name, reg_table[i].name, reg_table[i].namelen))
-            return &reg_table[i];
-    return NULL;
+    if (len < 3 || name[0] != '%' || name[1] != 'r')
+        return NULL;
+    if (len == 3) {
+        if (name[2] == '8')
+            return &reg_table[REG_R8];
+        if (name[2] == '9')
+            return &reg_table[REG_R9];
+        return NULL;
+    }
+    if (len != 4)
+        return NULL;
+    switch (name[2]) {
+      case 'a':
+        return name[3] == 'x' ? &reg_table[REG_RAX] : NULL;
+      case 'c':
+        return name[3] == 'x' ? &reg_table[REG_RCX] : NULL;
+      case 'd':
+        if (name[3] == 'x')
+            return &reg_table[REG_RDX];
+        return name[3] == 'i' ? &reg_table[REG_RDI] : NULL;
+      case 'b':
+        if (name[3] == 'x')
+            return &reg_table[REG_RBX];
+        return name[3] == 'p' ? &reg_table[REG_RBP] : NULL;
+      case 's':
+        if (name[3] == 'p')
+            return &reg_table[REG_RSP];
+        return name[3] == 'i' ? &reg_table[REG_RSI] : NULL;
+      case '1':
+        if (name[3] >= '0' && name[3] <= '4')
+            return &reg_table[REG_R10 + (name[3] - '0')];
+        return NULL;
+      default:
+        return NULL;
+    }
 }
 
+/* hash_span: FNV-1a hash of 'len' chars starting at 's' */
+static unsigned long hash_span(const char *s, int len)
+{
+    unsigned long h = 14695981039346656037UL;
+    while (len-- > 0) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
 
 /* instruction set */
 instr_t instr_set[] = {
@@ -82,23 +264,79 @@ instr_t instr_set[] = {
     {".quad", 5, HPACK(I_DIRECTIVE, D_DATA), 8 },
     {".pos", 4,  HPACK(I_DIRECTIVE, D_POS), 0 },
     {".align", 6,HPACK(I_DIRECTIVE, D_ALIGN), 0 },
+    {".global", 7,HPACK(I_DIRECTIVE, D_GLOBAL), 0 },
+    {".globl", 6,HPACK(I_DIRECTIVE, D_GLOBAL), 0 },
     {NULL, 1,    0   , 0 } //end
 };
 
-instr_t *find_instr(char *name)
+/*
+ * mnemonic hash index over instr_set, built once in init; the table is
+ * far larger than the instruction set so probe chains stay short
+ */
+#define INSTRHASH_SIZE 256
+
+instr_t *instrhash[INSTRHASH_SIZE];
+
+static instr_t **instrhash_slot(const char *name, int len)
 {
-    int i;
-    for (i = 0; instr_set[i].name; i++)
-	if (strncmp(instr_set[i].name, name, instr_set[i].len) == 0)
-	    return &instr_set[i];
-    return NULL;
+    unsigned long i = hash_span(name, len) & (INSTRHASH_SIZE - 1);
+    while (instrhash[i] != NULL &&
+           (instrhash[i]->len != len || memcmp(instrhash[i]->name, name, len)))
+        i = (i + 1) & (INSTRHASH_SIZE - 1);
+    return &instrhash[i];
+}
+
+static void instrhash_init(void)
+{
+    instr_t *inst;
+    for (inst = instr_set; inst->name; inst++)
+        *instrhash_slot(inst->name, inst->len) = inst;
+}
+
+instr_t *find_instr(const char *name, int len)
+{
+    return *instrhash_slot(name, len);
+}
+
+/*
+ * symbol hash index: open addressing with linear probing over the
+ * symbols in 'symtab', so lookups don't need to scan the list
+ */
+#define SYMHASH_INIT 1024
+
+
+/*
+ * symhash_slot: find the slot of 'name' in the hash index
+ *
+ * return
+ *     the slot holding 'name', or the empty slot where it should be inserted
+ */
+static symbol_t **symhash_slot(const char *name)
+{
+    unsigned long mask = as->symhash_size - 1;
+    unsigned long i = hash_span(name, strlen(name)) & mask;
+    while (as->symhash[i] != NULL && strcmp(as->symhash[i]->name, name))
+        i = (i + 1) & mask;
+    return &as->symhash[i];
 }
 
-/* symbol table (don't forget to init and finit it) */
-symbol_t *symtab = NULL;
+/* symhash_reserve: grow the hash index to hold 'nsym' symbols under 1/2 load */
+static void symhash_reserve(unsigned long nsym)
+{
+    symbol_t *stmp;
+
+    if (nsym * 2 <= as->symhash_size)
+        return;
+    free(as->symhash);
+    while (nsym * 2 > as->symhash_size)
+        as->symhash_size *= 2;
+    as->symhash = (symbol_t **)calloc(as->symhash_size, sizeof(symbol_t *));
+    for (stmp = as->symtab->next; stmp != NULL; stmp = stmp->next)
+        *symhash_slot(stmp->name) = stmp;
+}
 
 /*
- * find_symbol: scan table to find the symbol
+ * find_symbol: look up the symbol in the hash index
  * args
  *     name: the name of symbol
  *
@@ -108,14 +346,7 @@ symbol_t *symtab = NULL;
  */
 symbol_t *find_symbol(char *name)
 {
-  symbol_t *tempsym = symtab->next;
-  while (tempsym != NULL) {
-    if (!strcmp(tempsym->name, name)) {
-      return tempsym;
-    }
-    tempsym = tempsym->next;
-  }
-  return NULL;
+    return *symhash_slot(name);
 }
 
 /*
@@ -130,52 +361,57 @@ symbol_t *find_symbol(char *name)
 int add_symbol(char *name)
 {
     /* check duplicate */
-    if (find_symbol(name) != NULL) {
+    symbol_t **slot = symhash_slot(name);
+    if (*slot != NULL) {
       err_print("Dup symbol:%s", name);
       return -1;
     }
 
-    /* create new symbol_t (don't forget to free it)*/
-    symbol_t *tempsym = (symbol_t *)malloc(sizeof(symbol_t));
-    memset(tempsym, 0, sizeof(symbol_t));
+    /* create new symbol_t in the arena */
+    symbol_t *tempsym = (symbol_t *)arena_alloc(sizeof(symbol_t));
     tempsym->name = name;
 
-    /* add the new symbol_t to symbol table */
-    symbol_t *symlast = symtab;
-    while (symlast->next != NULL) {
-      symlast = symlast->next;
-    }
-    symlast->next = tempsym;
+    /* append the new symbol_t to symbol table and index it */
+    as->symtab_tail->next = tempsym;
+    as->symtab_tail = tempsym;
+    *slot = tempsym;
+
+    /* keep load factor under 1/2 */
+    symhash_reserve(++as->symhash_used);
     return 0;
 }
 
-/* relocation table (don't forget to init and finit it) */
-reloc_t *reltab = NULL;
-
 /*
  * add_reloc: add a new relocation to the relocation table
  * args
  *     name: the name of symbol
- *
- * return
- *     0: success
- *     -1: error, the symbol has exist
+ *     line: the line whose binary code to be relocated
  */
-void add_reloc(char *name, bin_t *bin)
+void add_reloc(char *name, line_t *line)
 {
-    /* create new reloc_t (don't forget to free it)*/
-    reloc_t *temprel = (reloc_t *)malloc(sizeof(reloc_t));
-    memset(temprel, 0, sizeof(reloc_t));
+    /* create new reloc_t in the arena */
+    reloc_t *temprel = (reloc_t *)arena_alloc(sizeof(reloc_t));
     temprel->name = name;
-    temprel->y64bin = bin;
+    temprel->line = line;
+    temprel->y64bin = &line->y64bin;
+    line->reloc = temprel;
 
-    /* add the new reloc_t to relocation table */
-    reloc_t *lastrel = reltab;
-    while (lastrel->next != NULL) {
-      lastrel = lastrel->next;
-    }
+    /* append the new reloc_t to relocation table */
+    as->reltab_tail->next = temprel;
+    as->reltab_tail = temprel;
+}
 
-    lastrel->next = temprel;
+/*
+ * add_global: export a symbol to other files (y64asm -c)
+ * args
+ *     name: the name of symbol, its label may be defined later
+ */
+void add_global(char *name)
+{
+    global_t *tempglob = (global_t *)arena_alloc(sizeof(global_t));
+    tempglob->name = name;
+    tempglob->next = as->globals;
+    as->globals = tempglob;
 }
 
 
@@ -187,13 +423,20 @@ void add_reloc(char *name, bin_t *bin)
 #define IS_IMM(s) (*(s)=='$')
 
 #define IS_BLANK(s) (*(s)==' ' || *(s)=='\t')
-#define IS_END(s) (*(s)=='\0')
+#define IS_END(s, e) ((s)>=(e))
 
-#define SKIP_BLANK(s) do {  \
-  while(!IS_END(s) && IS_BLANK(s))  \
+#define SKIP_BLANK(s, e) do {  \
+  while(!IS_END(s, e) && IS_BLANK(s))  \
     (s)++;    \
 } while(0);
 
+/*
+ * Every line is a span [ptr, end) inside the mapped source. The char at
+ * 'end' is always readable and is never a letter, digit or blank ('\n',
+ * '\r' or the zero byte after the file), so token scans and strtoul()
+ * stop at the end of the span without a NUL terminator.
+ */
+
 /* return value from different parse_xxx function */
 typedef enum { PARSE_ERR=-1, PARSE_REG, PARSE_DIGIT, PARSE_SYMBOL, 
     PARSE_MEM, PARSE_DELIM, PARSE_INSTR, PARSE_LABEL} parse_t;
@@ -202,6 +445,7 @@ typedef enum { PARSE_ERR=-1, PARSE_REG, PARSE_DIGIT, PARSE_SYMBOL,
  * parse_instr: parse an expected data token (e.g., 'rrmovq')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of the line
  *     inst: point to the inst_t within instr_set
  *
  * return
@@ -209,21 +453,26 @@ typedef enum { PARSE_ERR=-1, PARSE_REG, PARSE_DIGIT, PARSE_SYMBOL,
  *                            and store the pointer of the instruction to 'inst'
  *     PARSE_ERR: error, the value of 'ptr' and 'inst' are undefined
  */
-parse_t parse_instr(char **ptr, instr_t **inst)
+parse_t parse_instr(char **ptr, char *end, instr_t **inst)
 {
     /* skip the blank */
-    SKIP_BLANK(*ptr);
+    SKIP_BLANK(*ptr, end);
 
-    /* find_instr and check end */
-    char tempinstr[MAX_INSLEN] = "";
-    sscanf(*ptr, "%s", tempinstr);
-    *inst = find_instr(tempinstr);
+    /* the mnemonic is an optional '.' followed by letters */
+    int p = 0;
+    if (*ptr+p < end && **ptr == '.') {
+      p = p + 1;
+    }
+    while (*ptr+p < end && IS_LETTER(*ptr+p)) {
+      p = p + 1;
+    }
+    *inst = find_instr(*ptr, p);
     if (*inst == NULL) {
       return PARSE_ERR;
     }
 
     /* set 'ptr' and 'inst' */
-    *ptr = *ptr + (*inst)->len;
+    *ptr = *ptr + p;
     return PARSE_INSTR;
 }
 
@@ -231,15 +480,16 @@ parse_t parse_instr(char **ptr, instr_t **inst)
  * parse_delim: parse an expected delimiter token (e.g., ',')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of the line
  *
  * return
  *     PARSE_DELIM: success, move 'ptr' to the first char after token
  *     PARSE_ERR: error, the value of 'ptr' and 'delim' are undefined
  */
-parse_t parse_delim(char **ptr, char delim)
+parse_t parse_delim(char **ptr, char *end, char delim)
 {
     /* skip the blank and check */
-    SKIP_BLANK(*ptr);
+    SKIP_BLANK(*ptr, end);
     if (**ptr != delim) {
       err_print("Invalid '%c'", delim);
       return PARSE_ERR;
@@ -254,6 +504,7 @@ parse_t parse_delim(char **ptr, char delim)
  * parse_reg: parse an expected register token (e.g., '%rax')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of the line
  *     regid: point to the regid of register
  *
  * return
@@ -261,22 +512,20 @@ parse_t parse_delim(char **ptr, char delim)
  *                         and store the regid to 'regid'
  *     PARSE_ERR: error, the value of 'ptr' and 'regid' are undefined
  */
-parse_t parse_reg(char **ptr, regid_t *regid)
+parse_t parse_reg(char **ptr, char *end, regid_t *regid)
 {
     /* skip the blank and check */
-    SKIP_BLANK(*ptr);
+    SKIP_BLANK(*ptr, end);
     if (!IS_REG(*ptr)) {
       return PARSE_ERR;
     }
 
     /* find register */
-    char tempinstr[MAX_INSLEN] = "";
     int p = 1;
-    while (IS_LETTER(*ptr+p) || IS_DIGIT(*ptr+p)) {
+    while (*ptr+p < end && (IS_LETTER(*ptr+p) || IS_DIGIT(*ptr+p))) {
       p = p + 1;
     }
-    strncpy(tempinstr, *ptr, p);
-    const reg_t *tempreg = find_register(tempinstr);
+    const reg_t *tempreg = find_register(*ptr, p);
     if (tempreg == NULL) {
       err_print("Invalid REG");
       return PARSE_ERR;
@@ -292,6 +541,7 @@ parse_t parse_reg(char **ptr, regid_t *regid)
  * parse_symbol: parse an expected symbol token (e.g., 'Main')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of the line
  *     name: point to the name of symbol (should be allocated in this function)
  *
  * return
@@ -299,31 +549,306 @@ parse_t parse_reg(char **ptr, regid_t *regid)
  *                               and allocate and store name to 'name'
  *     PARSE_ERR: error, the value of 'ptr' and 'name' are undefined
  */
-parse_t parse_symbol(char **ptr, char **name)
+parse_t parse_symbol(char **ptr, char *end, char **name)
 {
     /* skip the blank and check */
-    SKIP_BLANK(*ptr);
+    SKIP_BLANK(*ptr, end);
     if (!IS_LETTER(*ptr)) {
       return PARSE_ERR;
     }
 
     /* allocate name and copy to it */
-    *name = (char *)malloc(MAX_INSLEN);
     int p = 0;
-    while (IS_LETTER(*ptr+p) || IS_DIGIT(*ptr+p)) {
-      *(*name + p) = *(*ptr + p);
+    while (*ptr+p < end && (IS_LETTER(*ptr+p) || IS_DIGIT(*ptr+p))) {
       p = p + 1;
     }
+    *name = arena_strndup(*ptr, p);
 
     /* set 'ptr' and 'name' */
     *ptr = *ptr + p;
     return PARSE_SYMBOL;
 }
 
+#define IS_IDENT(s) (IS_LETTER(s) || (*(s)>='0' && *(s)<='9') || *(s)=='_')
+
+/*
+ * preprocessor name index: open addressing with linear probing, like
+ * the symbol hash index, keyed by the 'len' chars of the name so the
+ * lookups can hash the identifier in the source line in place
+ */
+#define PPHASH_INIT 64
+
+/*
+ * pphash_slot: find the slot of the 'len' chars at 'name' in 'h', which
+ * must have slots
+ *
+ * return
+ *     the slot holding the name, or the empty slot where it should be inserted
+ */
+static ppslot_t *pphash_slot(pphash_t *h, const char *name, int len)
+{
+    unsigned long mask = h->size - 1;
+    unsigned long i = hash_span(name, len) & mask;
+    while (h->slot[i].name != NULL &&
+           (h->slot[i].len != len || memcmp(h->slot[i].name, name, len)))
+        i = (i + 1) & mask;
+    return &h->slot[i];
+}
+
+/* pphash_find: the item named by 'len' chars at 'name' in 'h', or NULL */
+static void *pphash_find(pphash_t *h, const char *name, int len)
+{
+    return h->used == 0 ? NULL : pphash_slot(h, name, len)->item;
+}
+
+/*
+ * pphash_put: index 'item' under its 'len' chars long 'name' (which must
+ * outlive 'h'), replacing the item of the same name if there is one
+ *
+ * return
+ *     0: success
+ *     -1: error, out of memory
+ */
+static int pphash_put(pphash_t *h, const char *name, int len, void *item)
+{
+    ppslot_t *s;
+
+    /* keep load factor under 1/2 */
+    if ((h->used + 1) * 2 > h->size) {
+        pphash_t old = *h;
+        unsigned long i;
+
+        h->size = old.size ? old.size * 2 : PPHASH_INIT;
+        h->slot = (ppslot_t *)calloc(h->size, sizeof(ppslot_t));
+        if (h->slot == NULL) {
+            *h = old;
+            err_print("Out of memory");
+            return -1;
+        }
+        for (i = 0; i < old.size; i++)
+            if (old.slot[i].name != NULL)
+                *pphash_slot(h, old.slot[i].name, old.slot[i].len) = old.slot[i];
+        free(old.slot);
+    }
+
+    s = pphash_slot(h, name, len);
+    if (s->name == NULL) {
+        s->name = name;
+        s->len = len;
+        h->used++;
+    }
+    s->item = item;
+    return 0;
+}
+
+/* find_const: look up the constant named by 'len' chars at 'name' */
+constant_t *find_const(const char *name, int len)
+{
+    return (constant_t *)pphash_find(&as->consthash, name, len);
+}
+
+/* ident_len: length of the identifier at 'ptr' */
+static int ident_len(char *ptr, char *end)
+{
+    int p = 0;
+    while (ptr + p < end && IS_IDENT(ptr + p))
+        p++;
+    return p;
+}
+
+/*
+ * constant expressions: numbers, constants, ( ), unary - + ~ and binary
+ *     * / %   + -   << >>   &   ^   |   (from high to low precedence)
+ * each level returns 0 on success and -1 on error
+ */
+static int expr_or(char **ptr, char *end, long *value);
+
+static int expr_unary(char **ptr, char *end, long *value)
+{
+    SKIP_BLANK(*ptr, end);
+    if (IS_END(*ptr, end))
+        return -1;
+    switch (**ptr) {
+      case '-':
+      case '+':
+      case '~': {
+        char op = **ptr;
+        *ptr = *ptr + 1;
+        if (expr_unary(ptr, end, value) < 0)
+            return -1;
+        if (op == '-')
+            *value = -*value;
+        else if (op == '~')
+            *value = ~*value;
+        return 0;
+      }
+      case '(':
+        *ptr = *ptr + 1;
+        if (expr_or(ptr, end, value) < 0)
+            return -1;
+        SKIP_BLANK(*ptr, end);
+        if (IS_END(*ptr, end) || **ptr != ')')
+            return -1;
+        *ptr = *ptr + 1;
+        return 0;
+      default:
+        break;
+    }
+    if (**ptr >= '0' && **ptr <= '9') {
+        char *endptr;
+        *value = strtoul(*ptr, &endptr, 0);
+        *ptr = endptr;
+        return 0;
+    }
+    if (IS_LETTER(*ptr) || **ptr == '_') {
+        int len = ident_len(*ptr, end);
+        constant_t *c = find_const(*ptr, len);
+        if (c == NULL)
+            return -1;
+        *value = c->value;
+        *ptr = *ptr + len;
+        return 0;
+    }
+    return -1;
+}
+
+static int expr_mul(char **ptr, char *end, long *value)
+{
+    long rhs;
+    if (expr_unary(ptr, end, value) < 0)
+        return -1;
+    for (;;) {
+        SKIP_BLANK(*ptr, end);
+        char op = IS_END(*ptr, end) ? '\0' : **ptr;
+        if (op != '*' && op != '/' && op != '%')
+            return 0;
+        *ptr = *ptr + 1;
+        if (expr_unary(ptr, end, &rhs) < 0)
+            return -1;
+        /* x / 0 and LONG_MIN / -1 trap, like x % 0 and LONG_MIN % -1 */
+        if (op != '*' && (rhs == 0 || (rhs == -1 && *value == LONG_MIN)))
+            return -1;
+        *value = op == '*' ? (long)((unsigned long)*value * rhs) :
+                 op == '/' ? *value / rhs : *value % rhs;
+    }
+}
+
+static int expr_add(char **ptr, char *end, long *value)
+{
+    long rhs;
+    if (expr_mul(ptr, end, value) < 0)
+        return -1;
+    for (;;) {
+        SKIP_BLANK(*ptr, end);
+        char op = IS_END(*ptr, end) ? '\0' : **ptr;
+        if (op != '+' && op != '-')
+            return 0;
+        *ptr = *ptr + 1;
+        if (expr_mul(ptr, end, &rhs) < 0)
+            return -1;
+        *value = op == '+' ? *value + rhs : *value - rhs;
+    }
+}
+
+static int expr_shift(char **ptr, char *end, long *value)
+{
+    long rhs;
+    if (expr_add(ptr, end, value) < 0)
+        return -1;
+    for (;;) {
+        SKIP_BLANK(*ptr, end);
+        if (*ptr + 1 >= end || (**ptr != '<' && **ptr != '>') || (*ptr)[1] != **ptr)
+            return 0;
+        char op = **ptr;
+        *ptr = *ptr + 2;
+        if (expr_add(ptr, end, &rhs) < 0)
+            return -1;
+        /* shifting by a negative count or by the width or more is undefined */
+        if (rhs < 0 || rhs >= 64)
+            return -1;
+        *value = op == '<' ? (long)((unsigned long)*value << rhs) : *value >> rhs;
+    }
+}
+
+static int expr_and(char **ptr, char *end, long *value)
+{
+    long rhs;
+    if (expr_shift(ptr, end, value) < 0)
+        return -1;
+    for (;;) {
+        SKIP_BLANK(*ptr, end);
+        if (IS_END(*ptr, end) || **ptr != '&')
+            return 0;
+        *ptr = *ptr + 1;
+        if (expr_shift(ptr, end, &rhs) < 0)
+            return -1;
+        *value &= rhs;
+    }
+}
+
+static int expr_xor(char **ptr, char *end, long *value)
+{
+    long rhs;
+    if (expr_and(ptr, end, value) < 0)
+        return -1;
+    for (;;) {
+        SKIP_BLANK(*ptr, end);
+        if (IS_END(*ptr, end) || **ptr != '^')
+            return 0;
+        *ptr = *ptr + 1;
+        if (expr_and(ptr, end, &rhs) < 0)
+            return -1;
+        *value ^= rhs;
+    }
+}
+
+static int expr_or(char **ptr, char *end, long *value)
+{
+    long rhs;
+    if (expr_xor(ptr, end, value) < 0)
+        return -1;
+    for (;;) {
+        SKIP_BLANK(*ptr, end);
+        if (IS_END(*ptr, end) || **ptr != '|')
+            return 0;
+        *ptr = *ptr + 1;
+        if (expr_xor(ptr, end, &rhs) < 0)
+            return -1;
+        *value |= rhs;
+    }
+}
+
+/*
+ * parse_expr: parse an expected constant expression (e.g., '8*N+4')
+ * args
+ *     ptr: point to the start of string
+ *     end: point to the end of the line
+ *     value: point to the value of expression
+ *
+ * return
+ *     PARSE_DIGIT: success, move 'ptr' to the first char after expression
+ *                            and store the value to 'value'
+ *     PARSE_ERR: error, the value of 'ptr' and 'value' are undefined
+ */
+parse_t parse_expr(char **ptr, char *end, long *value)
+{
+    return expr_or(ptr, end, value) < 0 ? PARSE_ERR : PARSE_DIGIT;
+}
+
+/* is_expr: the token at 'ptr' starts a constant expression */
+static bool_t is_expr(char *ptr, char *end)
+{
+    if (IS_DIGIT(ptr) || *ptr == '(' || *ptr == '~')
+        return TRUE;
+    return (IS_LETTER(ptr) || *ptr == '_') &&
+           find_const(ptr, ident_len(ptr, end)) != NULL;
+}
+
 /*
  * parse_digit: parse an expected digit token (e.g., '0x100')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of the line
  *     value: point to the value of digit
  *
  * return
@@ -331,27 +856,23 @@ parse_t parse_symbol(char **ptr, char **name)
  *                            and store the value of digit to 'value'
  *     PARSE_ERR: error, the value of 'ptr' and 'value' are undefined
  */
-parse_t parse_digit(char **ptr, long *value)
+parse_t parse_digit(char **ptr, char *end, long *value)
 {
     /* skip the blank and check */
-    SKIP_BLANK(*ptr);
-    if (!IS_DIGIT(*ptr)) {
+    SKIP_BLANK(*ptr, end);
+    if (!IS_DIGIT(*ptr) && !is_expr(*ptr, end)) {
       return PARSE_ERR;
     }
 
-    /* calculate the digit, (NOTE: see strtoll()) */
-    char *endptr;
-    *value = strtoul(*ptr, &endptr, 0);
-
-    /* set 'ptr' and 'value' */
-    *ptr = endptr;
-    return PARSE_DIGIT;
+    /* calculate the digit (or constant expression) and set 'ptr' and 'value' */
+    return parse_expr(ptr, end, value);
 }
 
 /*
  * parse_imm: parse an expected immediate token (e.g., '$0x100' or 'STACK')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of the line
  *     name: point to the name of symbol (should be allocated in this function)
  *     value: point to the value of digit
  *
@@ -364,27 +885,31 @@ parse_t parse_digit(char **ptr, long *value)
  *                            and allocate and store name to 'name' 
  *     PARSE_ERR: error, the value of 'ptr', 'name' and 'value' are undefined
  */
-parse_t parse_imm(char **ptr, char **name, long *value)
+parse_t parse_imm(char **ptr, char *end, char **name, long *value)
 {
     /* skip the blank and check */
-    SKIP_BLANK(*ptr);
+    SKIP_BLANK(*ptr, end);
 
     /* if IS_IMM, then parse the digit */
     if (**ptr == '$') {
       *ptr = *ptr + 1;
-      if (!IS_DIGIT(*ptr)) {
+      if (!is_expr(*ptr, end) || parse_expr(ptr, end, value) == PARSE_ERR) {
         err_print("Invalid Immediate");
         return PARSE_ERR;
       }
-      char *endptr;
-      *value = strtoul(*ptr, &endptr, 0);
-      *ptr = endptr;
       return PARSE_DIGIT;
     }
 
-    /* if IS_LETTER, then parse the symbol */
+    /* if IS_LETTER, then parse the constant or symbol */
     if (IS_LETTER(*ptr)) {
-      if (parse_symbol(ptr, name) == PARSE_ERR) {
+      if (is_expr(*ptr, end)) {
+        if (parse_expr(ptr, end, value) == PARSE_ERR) {
+          err_print("Invalid Immediate");
+          return PARSE_ERR;
+        }
+        return PARSE_DIGIT;
+      }
+      if (parse_symbol(ptr, end, name) == PARSE_ERR) {
         err_print("Invalid Immediate");
         return PARSE_ERR;
       }
@@ -400,6 +925,7 @@ parse_t parse_imm(char **ptr, char **name, long *value)
  * parse_mem: parse an expected memory token (e.g., '8(%rbp)')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of the line
  *     value: point to the value of digit
  *     regid: point to the regid of register
  *
@@ -409,16 +935,16 @@ parse_t parse_imm(char **ptr, char **name, long *value)
  *                          and store the regid to 'regid'
  *     PARSE_ERR: error, the value of 'ptr', 'value' and 'regid' are undefined
  */
-parse_t parse_mem(char **ptr, long *value, regid_t *regid)
+parse_t parse_mem(char **ptr, char *end, long *value, regid_t *regid)
 {
     /* skip the blank and check */
-    SKIP_BLANK(*ptr);
+    SKIP_BLANK(*ptr, end);
 
     /* calculate the digit and register, (ex: (%rbp) or 8(%rbp)) */
     if (**ptr == '(') {
       *value = 0;
     }else {
-      if (parse_digit(ptr, value) == PARSE_ERR) {
+      if (parse_digit(ptr, end, value) == PARSE_ERR) {
         err_print("Invalid MEM");
         return PARSE_ERR;
       }
@@ -428,7 +954,7 @@ parse_t parse_mem(char **ptr, long *value, regid_t *regid)
       return PARSE_ERR;
     }
     *ptr = *ptr + 1;
-    if (parse_reg(ptr, regid) == PARSE_ERR) {
+    if (parse_reg(ptr, end, regid) == PARSE_ERR) {
       err_print("Invalid MEM");
       return PARSE_ERR;
     }
@@ -446,6 +972,7 @@ parse_t parse_mem(char **ptr, long *value, regid_t *regid)
  * parse_data: parse an expected data token (e.g., '0x100' or 'array')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of the line
  *     name: point to the name of symbol (should be allocated in this function)
  *     value: point to the value of digit
  *
@@ -458,22 +985,19 @@ parse_t parse_mem(char **ptr, long *value, regid_t *regid)
  *                            and allocate and store name to 'name' 
  *     PARSE_ERR: error, the value of 'ptr', 'name' and 'value' are undefined
  */
-parse_t parse_data(char **ptr, char **name, long *value)
+parse_t parse_data(char **ptr, char *end, char **name, long *value)
 {
     /* skip the blank and check */
-    SKIP_BLANK(*ptr);
+    SKIP_BLANK(*ptr, end);
 
-    /* if IS_DIGIT, then parse the digit */
-    if (IS_DIGIT(*ptr)) {
-      char *endptr;
-      *value = strtoul(*ptr, &endptr, 0);
-      *ptr = endptr;
-      return PARSE_DIGIT;
+    /* if IS_DIGIT (or a constant), then parse the digit */
+    if (is_expr(*ptr, end)) {
+      return parse_expr(ptr, end, value);
     }
 
     /* if IS_LETTER, then parse the symbol */
     if (IS_LETTER(*ptr)) {
-      if (parse_symbol(ptr, name) == PARSE_ERR) {
+      if (parse_symbol(ptr, end, name) == PARSE_ERR) {
         return PARSE_ERR;
       }
       return PARSE_SYMBOL;
@@ -487,6 +1011,7 @@ parse_t parse_data(char **ptr, char **name, long *value)
  * parse_label: parse an expected label token (e.g., 'Loop:')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of the line
  *     name: point to the name of symbol (should be allocated in this function)
  *
  * return
@@ -494,24 +1019,23 @@ parse_t parse_data(char **ptr, char **name, long *value)
  *                            and allocate and store name to 'name'
  *     PARSE_ERR: error, the value of 'ptr' is undefined
  */
-parse_t parse_label(char **ptr, char **name)
+parse_t parse_label(char **ptr, char *end, char **name)
 {
     /* skip the blank and check */
-    SKIP_BLANK(*ptr);
+    SKIP_BLANK(*ptr, end);
     if (!IS_LETTER(*ptr)) {
       return PARSE_ERR;
     }
 
-    /* allocate name and copy to it */
-    *name = (char *)malloc(MAX_INSLEN);
+    /* check the ':' before allocating name */
     int p = 0;
-    while (IS_LETTER(*ptr+p) || IS_DIGIT(*ptr+p)) {
-      *(*name + p) = *(*ptr + p);
+    while (*ptr+p < end && (IS_LETTER(*ptr+p) || IS_DIGIT(*ptr+p))) {
       p = p + 1;
     }
     if (*(*ptr + p) != ':') {
       return PARSE_ERR;
     }
+    *name = arena_strndup(*ptr, p);
 
     /* set 'ptr' and 'name' */
     *ptr = *ptr + p + 1;
@@ -536,12 +1060,13 @@ type_t parse_line(line_t *line)
 *  Loop: mrmovl (%rbp), %rcx
 *           call SUM  #invoke SUM function */
     char *templine = line->y64asm;
+    char *lineend = line->y64asm + line->asmlen;
     char *tempname = NULL;
     instr_t *tempinst = NULL;
 
     /* skip blank and check IS_END */
-    SKIP_BLANK(templine);
-    if (IS_END(templine)) {
+    SKIP_BLANK(templine, lineend);
+    if (IS_END(templine, lineend)) {
       return TYPE_COMM;
     }
 
@@ -551,23 +1076,25 @@ type_t parse_line(line_t *line)
     }
 
     /* is a label ? */
-    if (parse_label(&templine, &tempname) == PARSE_LABEL) {
+    if (parse_label(&templine, lineend, &tempname) == PARSE_LABEL) {
       if (add_symbol(tempname) == -1) {
         line->type = TYPE_ERR;
         return line->type;
       }
-      symbol_t *tempsym = find_symbol(tempname);
-      tempsym->addr = vmaddr;
-      SKIP_BLANK(templine);
-      if (IS_END(templine) || IS_COMMENT(templine)) {
+      symbol_t *tempsym = as->symtab_tail;
+      tempsym->addr = as->vmaddr;
+      tempsym->line = line;
+      line->label = tempsym;
+      SKIP_BLANK(templine, lineend);
+      if (IS_END(templine, lineend) || IS_COMMENT(templine)) {
         line->type = TYPE_INS;
-        line->y64bin.addr = vmaddr;
+        line->y64bin.addr = as->vmaddr;
         return TYPE_INS;
       }
     }
 
     /* is an instruction ? */
-    if (parse_instr(&templine, &tempinst) == PARSE_ERR) {
+    if (parse_instr(&templine, lineend, &tempinst) == PARSE_ERR) {
       line->type = TYPE_ERR;
       err_print("invalid instruction");
       return line->type;
@@ -575,12 +1102,13 @@ type_t parse_line(line_t *line)
 
     /* set type and y64bin */
     line->type = TYPE_INS;
-    line->y64bin.addr = vmaddr;
+    line->inst = tempinst;
+    line->y64bin.addr = as->vmaddr;
     line->y64bin.bytes = tempinst->bytes;
     line->y64bin.codes[0] = tempinst->code;
 
     /* update vmaddr */
-    vmaddr = vmaddr + tempinst->bytes;
+    as->vmaddr = as->vmaddr + tempinst->bytes;
     /* parse the rest of instruction according to the itype */
     regid_t rega;
     regid_t regb;
@@ -592,50 +1120,50 @@ type_t parse_line(line_t *line)
       case I_RET:
         break;
       case I_RRMOVQ:
-        if (parse_reg(&templine, &rega) == PARSE_ERR) {
+        if (parse_reg(&templine, lineend, &rega) == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        if (parse_delim(&templine, ',') == PARSE_ERR) {
+        if (parse_delim(&templine, lineend, ',') == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        if (parse_reg(&templine, &regb) == PARSE_ERR) {
+        if (parse_reg(&templine, lineend, &regb) == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
         line->y64bin.codes[1] = HPACK(rega, regb);
         break;
       case I_IRMOVQ: /* irmovq symbol, %rax */
-        parsetype = parse_imm(&templine, &tempname, &value);
+        parsetype = parse_imm(&templine, lineend, &tempname, &value);
         if (parsetype == PARSE_SYMBOL) {
-          add_reloc(tempname, &line->y64bin);
+          add_reloc(tempname, line);
         }else if (parsetype == PARSE_DIGIT) {
           memcpy(line->y64bin.codes + 2, (void *)&value, sizeof(long));
         }else{
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        if (parse_delim(&templine, ',') == PARSE_ERR) {
+        if (parse_delim(&templine, lineend, ',') == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        if (parse_reg(&templine, &regb) != PARSE_REG) {
+        if (parse_reg(&templine, lineend, &regb) != PARSE_REG) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
         line->y64bin.codes[1] = HPACK(REG_NONE, regb);
         break;
       case I_RMMOVQ: /* 4:0 regA:regB imm */
-        if (parse_reg(&templine, &rega) == PARSE_ERR) {
+        if (parse_reg(&templine, lineend, &rega) == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        if (parse_delim(&templine, ',') == PARSE_ERR) {
+        if (parse_delim(&templine, lineend, ',') == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        if (parse_mem(&templine, &value, &regb) == PARSE_ERR) {
+        if (parse_mem(&templine, lineend, &value, &regb) == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
@@ -643,15 +1171,15 @@ type_t parse_line(line_t *line)
         memcpy(line->y64bin.codes + 2, (void *)&value, sizeof(long));
         break;
       case I_MRMOVQ: /* 5:0 regB:regA imm */
-        if (parse_mem(&templine, &value, &rega) == PARSE_ERR) {
+        if (parse_mem(&templine, lineend, &value, &rega) == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        if (parse_delim(&templine, ',') == PARSE_ERR) {
+        if (parse_delim(&templine, lineend, ',') == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        if (parse_reg(&templine, &regb) == PARSE_ERR) {
+        if (parse_reg(&templine, lineend, &regb) == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
@@ -659,15 +1187,15 @@ type_t parse_line(line_t *line)
         memcpy(line->y64bin.codes + 2, (void *)&value, sizeof(long));
         break;
       case I_ALU: /* 6:x regA:regB */
-        if (parse_reg(&templine, &rega) == PARSE_ERR) {
+        if (parse_reg(&templine, lineend, &rega) == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        if (parse_delim(&templine, ',') == PARSE_ERR) {
+        if (parse_delim(&templine, lineend, ',') == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        if (parse_reg(&templine, &regb) == PARSE_ERR) {
+        if (parse_reg(&templine, lineend, &regb) == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
@@ -675,16 +1203,16 @@ type_t parse_line(line_t *line)
         break;
       case I_JMP:
       case I_CALL:
-        if (parse_symbol(&templine, &tempname) == PARSE_ERR) {
+        if (parse_symbol(&templine, lineend, &tempname) == PARSE_ERR) {
           err_print("Invalid DEST");
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
-        add_reloc(tempname, &line->y64bin);
+        add_reloc(tempname, line);
         break;
       case I_PUSHQ:
       case I_POPQ:
-        if (parse_reg(&templine, &rega) == PARSE_ERR) {
+        if (parse_reg(&templine, lineend, &rega) == PARSE_ERR) {
           line->type = TYPE_ERR;
           return TYPE_ERR;
         }
@@ -692,57 +1220,73 @@ type_t parse_line(line_t *line)
         break;
       case I_DIRECTIVE:
         if (!strcmp(tempinst->name, ".pos")) {
-          if (parse_digit(&templine, &value) == PARSE_ERR) {
+          if (parse_digit(&templine, lineend, &value) == PARSE_ERR) {
             line->type = TYPE_ERR;
             return line->type;
           }
-          vmaddr = value;
-          line->y64bin.addr = vmaddr;
+          as->vmaddr = value;
+          line->y64bin.addr = as->vmaddr;
         }else if (!strcmp(tempinst->name, ".align")) {
-          if (parse_digit(&templine, &value) == PARSE_ERR) {
+          if (parse_digit(&templine, lineend, &value) == PARSE_ERR) {
             line->type = TYPE_ERR;
             return line->type;
           }
-          if (vmaddr % value != 0) {
-            vmaddr = vmaddr + (value - vmaddr % value);
-            line->y64bin.addr = vmaddr;
+          if (as->vmaddr % value != 0) {
+            as->vmaddr = as->vmaddr + (value - as->vmaddr % value);
+            line->y64bin.addr = as->vmaddr;
+          }
+          /* no code for .align, keep the alignment for relayout */
+          memcpy(line->y64bin.codes, (void *)&value, sizeof(long));
+        }else if (LOW(tempinst->code) == D_GLOBAL) {
+          /* .global name, ... (.globl is the same) */
+          for (;;) {
+            if (parse_symbol(&templine, lineend, &tempname) == PARSE_ERR) {
+              err_print("Invalid global symbol");
+              line->type = TYPE_ERR;
+              return line->type;
+            }
+            add_global(tempname);
+            SKIP_BLANK(templine, lineend);
+            if (IS_END(templine, lineend) || *templine != ',')
+              break;
+            templine++;
           }
         }else if (!strcmp(tempinst->name, ".byte")) {
-          parsetype = parse_data(&templine, &tempname, &value);
+          parsetype = parse_data(&templine, lineend, &tempname, &value);
           if (parsetype == PARSE_DIGIT) {
             memcpy(line->y64bin.codes, (void*)&value, 1);
           }else if (parsetype == PARSE_SYMBOL) {
-            add_reloc(tempname, &line->y64bin);
+            add_reloc(tempname, line);
           }else{
             line->type = TYPE_ERR;
             return line->type;
           }
         }else if (!strcmp(tempinst->name, ".word")) {
-          parsetype = parse_data(&templine, &tempname, &value);
+          parsetype = parse_data(&templine, lineend, &tempname, &value);
           if (parsetype == PARSE_DIGIT) {
             memcpy(line->y64bin.codes, (void*)&value, 2);
           }else if (parsetype == PARSE_SYMBOL) {
-            add_reloc(tempname, &line->y64bin);
+            add_reloc(tempname, line);
           }else{
             line->type = TYPE_ERR;
             return line->type;
           }
         }else if (!strcmp(tempinst->name, ".long")) {
-          parsetype = parse_data(&templine, &tempname, &value);
+          parsetype = parse_data(&templine, lineend, &tempname, &value);
           if (parsetype == PARSE_DIGIT) {
             memcpy(line->y64bin.codes, (void*)&value, 4);
           }else if (parsetype == PARSE_SYMBOL) {
-            add_reloc(tempname, &line->y64bin);
+            add_reloc(tempname, line);
           }else{
             line->type = TYPE_ERR;
             return line->type;
           }
         }else if (!strcmp(tempinst->name, ".quad")) {
-          parsetype = parse_data(&templine, &tempname, &value);
+          parsetype = parse_data(&templine, lineend, &tempname, &value);
           if (parsetype == PARSE_DIGIT) {
             memcpy(line->y64bin.codes, (void*)&value, 8);
           }else if (parsetype == PARSE_SYMBOL) {
-            add_reloc(tempname, &line->y64bin);
+            add_reloc(tempname, line);
           }else{
             line->type = TYPE_ERR;
             return line->type;
@@ -756,8 +1300,8 @@ type_t parse_line(line_t *line)
         line->type = TYPE_ERR;
         return line->type;
     }
-    SKIP_BLANK(templine);
-    if (IS_END(templine) || IS_COMMENT(templine)) {
+    SKIP_BLANK(templine, lineend);
+    if (IS_END(templine, lineend) || IS_COMMENT(templine)) {
       return line->type;
     }
     line->type = TYPE_ERR;
@@ -765,242 +1309,1692 @@ type_t parse_line(line_t *line)
 }
 
 /*
- * assemble: assemble an y64 file (e.g., 'asum.ys')
- * args
- *     in: point to input file (an y64 assembly file)
+ * map_source: map the whole input file read-only into 'src_buf', and
+ * reserve one more zero byte after it (the anonymous mapping) so the char
+ * at the end of the last line is readable even if it has no '\n'
  *
  * return
- *     0: success, assmble the y64 file to a list of line_t
- *     -1: error, try to print err information (e.g., instr type and line number)
+ *     0: success
+ *     -1: error
  */
-int assemble(FILE *in)
+int map_source(FILE *in)
 {
-    static char asm_buf[MAX_INSLEN]; /* the current line of asm code */
-    line_t *line;
-    int slen;
-    char *y64asm;
-
-    /* read y64 code line-by-line, and parse them to generate raw y64 binary code list */
-    while (fgets(asm_buf, MAX_INSLEN, in) != NULL) {
-        slen  = strlen(asm_buf);
-        while ((asm_buf[slen-1] == '\n') || (asm_buf[slen-1] == '\r')) { 
-            asm_buf[--slen] = '\0'; /* replace terminator */
-        }
-
-        /* store y64 assembly code */
-        y64asm = (char *)malloc(sizeof(char) * (slen + 1)); // free in finit
-        strcpy(y64asm, asm_buf);
+    struct stat st;
+    long pagesz = sysconf(_SC_PAGESIZE);
 
-        line = (line_t *)malloc(sizeof(line_t)); // free in finit
-        memset(line, '\0', sizeof(line_t));
-
-        line->type = TYPE_COMM;
-        line->y64asm = y64asm;
-        line->next = NULL;
-
-        line_tail->next = line;
-        line_tail = line;
-        lineno ++;
-        if (parse_line(line) == TYPE_ERR) {
-            return -1;
-        }
+    if (fstat(fileno(in), &st) < 0) {
+        err_print("Can't stat input file");
+        return -1;
     }
 
-	lineno = -1;
+    as->src_len = st.st_size;
+    as->src_maplen = (as->src_len + 1 + pagesz - 1) & ~(size_t)(pagesz - 1);
+    as->src_buf = mmap(NULL, as->src_maplen, PROT_READ,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (as->src_buf == MAP_FAILED) {
+        as->src_buf = NULL;
+        err_print("Can't map input file");
+        return -1;
+    }
+    if (as->src_len > 0 &&
+        mmap(as->src_buf, as->src_len, PROT_READ,
+             MAP_PRIVATE | MAP_FIXED, fileno(in), 0) == MAP_FAILED) {
+        err_print("Can't map input file");
+        return -1;
+    }
     return 0;
 }
 
+/* append_line: append a line_t for the 'len' chars of code at 'text' */
+static line_t *append_line(char *text, int len)
+{
+    line_t *line = (line_t *)arena_alloc(sizeof(line_t));
+    line->type = TYPE_COMM;
+    line->y64asm = text;
+    line->asmlen = len;
+    line->next = NULL;
+
+    as->line_tail->next = line;
+    as->line_tail = line;
+    return line;
+}
+
 /*
- * relocate: relocate the raw y64 binary code with symbol address
- *
- * return
- *     0: success
- *     -1: error, try to print err information (e.g., addr and symbol)
+ * new_line: append a line_t for the source line starting at '*cur'
+ * and move '*cur' to the start of next line
  */
-int relocate(void)
+line_t *new_line(char **cur)
 {
-    reloc_t *rtmp = NULL;
-    rtmp = reltab->next;
-    while (rtmp) {
-        /* find symbol */
-        symbol_t *tempsym = find_symbol(rtmp->name);
-        if (tempsym == NULL) {
-          err_print("Unknown symbol:'%s'", rtmp->name);
-          return -1;
-        }
-
-        /* relocate y64bin according itype */
-        int pos;
-        switch (HIGH(rtmp->y64bin->codes[0])) {
-          case I_IRMOVQ:
-          case I_JMP:
-          case I_CALL:
-            pos = rtmp->y64bin->bytes - 8;
-            memcpy(rtmp->y64bin->codes + pos, (void *)&tempsym->addr, 8);
-            break;
-          case I_DIRECTIVE:
+    char *end = as->src_buf + as->src_len;
+    char *eol = memchr(*cur, '\n', end - *cur);
+    size_t slen;
+    line_t *line;
 
-            if (rtmp->y64bin->bytes == 1) {
-              pos = rtmp->y64bin->bytes - 1;
-              memcpy(rtmp->y64bin->codes + pos, (void *)&tempsym->addr, 1);
-            }else if(rtmp->y64bin->bytes == 2){
-              pos = rtmp->y64bin->bytes - 2;
-              memcpy(rtmp->y64bin->codes + pos, (void *)&tempsym->addr, 2);
-            }else if(rtmp->y64bin->bytes == 4){
-              pos = rtmp->y64bin->bytes - 4;
-              memcpy(rtmp->y64bin->codes + pos, (void *)&tempsym->addr, 4);
-            }else if(rtmp->y64bin->bytes == 8){
-              pos = rtmp->y64bin->bytes - 8;
-              memcpy(rtmp->y64bin->codes + pos, (void *)&tempsym->addr, 8);
-            }
-        }
+    if (eol == NULL)
+        eol = end;
+    slen = eol - *cur;
+    while (slen > 0 && (*cur)[slen-1] == '\r')
+        slen--;
 
-        /* next */
-        rtmp = rtmp->next;
-    }
-    return 0;
+    line = append_line(*cur, slen);
+    *cur = eol + 1;
+    return line;
 }
 
 /*
- * binfile: generate the y64 binary file
- * args
- *     out: point to output file (an y64 binary file)
+ * preprocessor: .macro/.endm, .rept/.endr and .set/.equ are handled before
+ * parse_line. Their own lines stay comments in the listing, and every
+ * expanded line is appended as a new line_t right after them, so the
+ * listing shows the unrolled code. Errors in expanded lines report the
+ * line of the invocation (macros) or of the body (.rept).
+ */
+#define PP_MAXDEPTH 64  /* max nesting of expansions */
+
+static int pp_line(line_t *line, int origin, int depth);
+
+/*
+ * pp_directive: find the preprocessor directive that starts the line
  *
  * return
- *     0: success
- *     -1: error
+ *     PP_XXX: the directive, move '*ptr' to the first char after it
+ *     PP_NONE: not a preprocessor directive
  */
-int binfile(FILE *out)
+static ppdir_t pp_directive(char **ptr, char *end)
 {
-    /* prepare image with&(stmp->addr) y64 binary code */
-    line_t *headline = line_head->next;
-    line_t *templine = headline;
-    int filesize = 0;
-    while (templine != NULL) {
-      if (templine->type == TYPE_INS && templine->y64bin.bytes > 0) {
-        filesize = templine->y64bin.addr + templine->y64bin.bytes;
-      }
-      templine = templine->next;
-    }
-    byte_t *image = (byte_t *)malloc(filesize);
-    memset(image, 0, filesize);
-    templine = headline;
-    while (templine != NULL) {
-      if (templine->type == TYPE_INS && templine->y64bin.bytes > 0) {
-//        err_print("%x", templine->y64bin.addr);
-//        err_print("%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x", templine->y64bin.codes[0], templine->y64bin.codes[1], templine->y64bin.codes[2],
-//                  templine->y64bin.codes[3], templine->y64bin.codes[4], templine->y64bin.codes[5], templine->y64bin.codes[6],
-//                  templine->y64bin.codes[7], templine->y64bin.codes[8], templine->y64bin.codes[9]);
-//        err_print("%d",templine->y64bin.bytes);
-        memcpy(image + templine->y64bin.addr, templine->y64bin.codes, templine->y64bin.bytes);
-      }
-      templine = templine->next;
+    static const struct { const char *name; ppdir_t dir; } dirs[] = {
+        {".macro", PP_MACRO}, {".rept", PP_REPT}, {".endm", PP_ENDM},
+        {".endr", PP_ENDR}, {".set", PP_SET}, {".equ", PP_SET},
+    };
+    char *p = *ptr;
+    int len, i;
+
+    SKIP_BLANK(p, end);
+    if (IS_END(p, end) || *p != '.')
+        return PP_NONE;
+    len = 1 + ident_len(p + 1, end);
+    for (i = 0; i < (int)(sizeof(dirs) / sizeof(dirs[0])); i++)
+        if ((int)strlen(dirs[i].name) == len && !memcmp(dirs[i].name, p, len)) {
+            *ptr = p + len;
+            return dirs[i].dir;
+        }
+    return PP_NONE;
+}
+
+/* find_macro: look up the macro named by 'len' chars at 'name' */
+static macro_t *find_macro(const char *name, int len)
+{
+    return (macro_t *)pphash_find(&as->macrohash, name, len);
+}
+
+/* pp_rest_empty: only blanks or a comment are left on the line */
+static bool_t pp_rest_empty(char *ptr, char *end)
+{
+    SKIP_BLANK(ptr, end);
+    return IS_END(ptr, end) || IS_COMMENT(ptr);
+}
+
+/*
+ * pp_subst: substitute '\arg' by 'vals' and '\@' by 'serial' in the
+ * 'len' chars of body line at 'text'
+ *
+ * return
+ *     the line after substitution (allocated in the arena)
+ */
+static char *pp_subst(char *text, int len, macro_t *mac, char **vals,
+                      int *vlens, int serial, int *outlen)
+{
+    char num[16];
+    int numlen = sprintf(num, "%d", serial);
+    char *buf = NULL;
+    int pass, n = 0;
+
+    /* count the length in the first pass, copy in the second one */
+    for (pass = 0; pass < 2; pass++) {
+        char *p = text, *end = text + len;
+        n = 0;
+        if (pass == 1)
+            buf = (char *)arena_alloc(*outlen + 1);
+        while (p < end) {
+            const char *val = p;
+            int vlen = 1, skip = 1;
+            if (*p == '\\' && p + 1 < end) {
+                if (p[1] == '@') {
+                    val = num;
+                    vlen = numlen;
+                    skip = 2;
+                } else if (mac != NULL) {
+                    int alen = ident_len(p + 1, end), i;
+                    for (i = 0; i < mac->nargs; i++)
+                        if ((int)strlen(mac->args[i]) == alen &&
+                            !memcmp(mac->args[i], p + 1, alen)) {
+                            val = vals[i];
+                            vlen = vlens[i];
+                            skip = 1 + alen;
+                            break;
+                        }
+                }
+            }
+            if (pass == 1)
+                memcpy(buf + n, val, vlen);
+            n += vlen;
+            p += skip;
+        }
+        *outlen = n;
+    }
+    buf[n] = '\0';
+    return buf;
+}
+
+/* pp_expand: append and preprocess one expanded line */
+static int pp_expand(char *text, int len, int origin, int depth)
+{
+    line_t *line = append_line(text, len);
+    return pp_line(line, origin, depth + 1);
+}
+
+/* pp_finish: the recorded block is closed, define or unroll it */
+static int pp_finish(int depth)
+{
+    ppdir_t kind = as->pp_kind;
+    ppline_t *body = as->pp_body;
+    long count = as->pp_count, i;
+    ppline_t *pl;
+
+    as->pp_kind = PP_NONE;
+    as->pp_body = as->pp_body_tail = NULL;
+    if (kind == PP_MACRO) {
+        macro_t *mac = as->pp_macro;
+
+        /* a later definition replaces an earlier one of the same name */
+        as->pp_macro = NULL;
+        mac->body = body;
+        return pphash_put(&as->macrohash, mac->name, strlen(mac->name), mac);
+    }
+
+    for (i = 0; i < count; i++) {
+        int serial = as->pp_serial++;
+        for (pl = body; pl != NULL; pl = pl->next) {
+            int len;
+            char *text = pp_subst(pl->text, pl->len, NULL, NULL, NULL,
+                                  serial, &len);
+            if (pp_expand(text, len, pl->lineno, depth) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* pp_define: start recording the body of '.macro name arg, ...' */
+static int pp_define(char *ptr, char *end)
+{
+    macro_t *mac = (macro_t *)arena_alloc(sizeof(macro_t));
+    int len;
+
+    SKIP_BLANK(ptr, end);
+    len = ident_len(ptr, end);
+    if (len == 0 || !IS_LETTER(ptr)) {
+        err_print("Invalid macro name");
+        return -1;
+    }
+    mac->name = arena_strndup(ptr, len);
+    ptr += len;
+    for (;;) {
+        SKIP_BLANK(ptr, end);
+        if (IS_END(ptr, end) || IS_COMMENT(ptr))
+            break;
+        if (*ptr == ',' && mac->nargs > 0) {
+            ptr++;
+            SKIP_BLANK(ptr, end);
+        }
+        len = ident_len(ptr, end);
+        if (len == 0 || mac->nargs == MAX_MACRO_ARGS) {
+            err_print("Invalid macro arguments");
+            return -1;
+        }
+        mac->args[mac->nargs++] = arena_strndup(ptr, len);
+        ptr += len;
+    }
+    as->pp_macro = mac;
+    return 0;
+}
+
+/* pp_invoke: expand the macro 'mac', its arguments start at 'ptr' */
+static int pp_invoke(macro_t *mac, char *ptr, char *end, int origin,
+                     int depth)
+{
+    char *vals[MAX_MACRO_ARGS];
+    int vlens[MAX_MACRO_ARGS];
+    int nvals = 0, serial, len;
+    ppline_t *pl;
+
+    /* arguments are separated by commas, blanks around them are dropped */
+    SKIP_BLANK(ptr, end);
+    while (!IS_END(ptr, end) && !IS_COMMENT(ptr)) {
+        char *vend = ptr;
+        while (vend < end && *vend != ',' && !IS_COMMENT(vend))
+            vend++;
+        if (nvals == MAX_MACRO_ARGS) {
+            err_print("Wrong number of macro arguments");
+            return -1;
+        }
+        vals[nvals] = ptr;
+        vlens[nvals] = vend - ptr;
+        while (vlens[nvals] > 0 && IS_BLANK(ptr + vlens[nvals] - 1))
+            vlens[nvals]--;
+        nvals++;
+        ptr = vend;
+        if (ptr < end && *ptr == ',') {
+            ptr++;
+            SKIP_BLANK(ptr, end);
+        }
+    }
+    if (nvals != mac->nargs) {
+        err_print("Wrong number of macro arguments");
+        return -1;
+    }
+
+    serial = as->pp_serial++;
+    for (pl = mac->body; pl != NULL; pl = pl->next) {
+        char *text = pp_subst(pl->text, pl->len, mac, vals, vlens,
+                              serial, &len);
+        if (pp_expand(text, len, origin, depth) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* pp_set: '.set name, expr' defines or redefines a constant */
+static int pp_set(char *ptr, char *end)
+{
+    constant_t *c;
+    long value;
+    int len;
+
+    SKIP_BLANK(ptr, end);
+    len = ident_len(ptr, end);
+    if (len == 0 || !IS_LETTER(ptr)) {
+        err_print("Invalid constant name");
+        return -1;
+    }
+    char *name = ptr;
+    ptr += len;
+    if (parse_delim(&ptr, end, ',') == PARSE_ERR)
+        return -1;
+    SKIP_BLANK(ptr, end);
+    if (parse_expr(&ptr, end, &value) == PARSE_ERR ||
+        !pp_rest_empty(ptr, end)) {
+        err_print("Invalid expression");
+        return -1;
+    }
+
+    c = find_const(name, len);
+    if (c == NULL) {
+        c = (constant_t *)arena_alloc(sizeof(constant_t));
+        c->name = arena_strndup(name, len);
+        if (pphash_put(&as->consthash, c->name, len, c) < 0)
+            return -1;
+    }
+    c->value = value;
+    return 0;
+}
+
+/*
+ * pp_line: preprocess a line, then parse it if it's left as code
+ * args
+ *     line: the line (from source or expanded)
+ *     origin: the source line number reported by err_print
+ *     depth: nesting of expansions
+ *
+ * return
+ *     0: success
+ *     -1: error
+ */
+static int pp_line(line_t *line, int origin, int depth)
+{
+    char *ptr = line->y64asm;
+    char *end = line->y64asm + line->asmlen;
+    ppdir_t dir = pp_directive(&ptr, end);
+
+    as->lineno = origin;
+    if (depth > PP_MAXDEPTH) {
+        err_print("Too deep macro or .rept expansion");
+        return -1;
+    }
+
+    /* record the body until the matching .endm/.endr */
+    if (as->pp_kind != PP_NONE) {
+        if (dir == PP_MACRO || dir == PP_REPT) {
+            as->pp_nest++;
+        } else if ((dir == PP_ENDM || dir == PP_ENDR) && as->pp_nest > 0) {
+            as->pp_nest--;
+        } else if (dir == PP_ENDM || dir == PP_ENDR) {
+            if ((dir == PP_ENDM) != (as->pp_kind == PP_MACRO)) {
+                err_print("Unmatched %s", dir == PP_ENDM ? ".endm" : ".endr");
+                return -1;
+            }
+            return pp_finish(depth);
+        }
+        ppline_t *pl = (ppline_t *)arena_alloc(sizeof(ppline_t));
+        pl->text = line->y64asm;
+        pl->len = line->asmlen;
+        pl->lineno = origin;
+        if (as->pp_body_tail)
+            as->pp_body_tail->next = pl;
+        else
+            as->pp_body = pl;
+        as->pp_body_tail = pl;
+        return 0;
+    }
+
+    switch (dir) {
+      case PP_MACRO:
+      case PP_REPT:
+        if (dir == PP_MACRO) {
+            if (pp_define(ptr, end) < 0)
+                return -1;
+        } else {
+            SKIP_BLANK(ptr, end);
+            if (parse_expr(&ptr, end, &as->pp_count) == PARSE_ERR ||
+                !pp_rest_empty(ptr, end) || as->pp_count < 0) {
+                err_print("Invalid .rept count");
+                return -1;
+            }
+        }
+        as->pp_kind = dir;
+        as->pp_nest = 0;
+        as->pp_start = origin;
+        return 0;
+      case PP_ENDM:
+      case PP_ENDR:
+        err_print("Unmatched %s", dir == PP_ENDM ? ".endm" : ".endr");
+        return -1;
+      case PP_SET:
+        return pp_set(ptr, end);
+      default:
+        break;
+    }
+
+    /* a macro invocation ? */
+    if (as->macrohash.used != 0) {
+        SKIP_BLANK(ptr, end);
+        if (!IS_END(ptr, end) && IS_LETTER(ptr)) {
+            int len = ident_len(ptr, end);
+            macro_t *mac = find_macro(ptr, len);
+            if (mac != NULL)
+                return pp_invoke(mac, ptr + len, end, origin, depth);
+        }
+    }
+
+    return parse_line(line) == TYPE_ERR ? -1 : 0;
+}
+
+/*
+ * assemble_lines: assemble the y64 code in source buffer
+ *
+ * return
+ *     0: success, assmble the y64 code to a list of line_t
+ *     -1: error, try to print err information (e.g., instr type and line number)
+ */
+int assemble_lines(void)
+{
+    char *cur, *end;
+    line_t *line;
+    int srcline = 0;
+
+    /* split y64 code line-by-line, and parse them to generate raw y64 binary code list */
+    cur = as->src_buf;
+    end = as->src_buf + as->src_len;
+    while (cur < end) {
+        line = new_line(&cur);
+        if (pp_line(line, ++srcline, 0) < 0) {
+            return -1;
+        }
+    }
+    if (as->pp_kind != PP_NONE) {
+        as->lineno = as->pp_start;
+        err_print("Unterminated %s", as->pp_kind == PP_MACRO ? ".macro" : ".rept");
+        return -1;
+    }
+
+	as->lineno = -1;
+    return 0;
+}
+
+/*
+ * assemble: assemble an y64 file (e.g., 'asum.ys')
+ * args
+ *     in: point to input file (an y64 assembly file)
+ *
+ * return
+ *     0: success, assmble the y64 file to a list of line_t
+ *     -1: error, try to print err information (e.g., instr type and line number)
+ */
+int assemble(FILE *in)
+{
+    if (map_source(in) < 0)
+        return -1;
+    return assemble_lines();
+}
+
+/*
+ * peephole optimizer (y64asm -O): rewrite the parsed lines before
+ * relocate, then lay them out again so addresses and labels stay right
+ */
+
+#define OPT_MAXPASS 8   /* max rounds over the lines */
+#define OPT_MAXHOPS 16  /* max jumps followed when threading a jump */
+#define OPT_MAXSCAN 64  /* max instructions scanned for a use of flags */
+
+#define ICODE(l) HIGH((l)->inst->code)
+#define IFUN(l) LOW((l)->inst->code)
+#define RA(l) HIGH((l)->y64bin.codes[1])
+#define RB(l) LOW((l)->y64bin.codes[1])
+
+/* is_code: the line has an instruction (not a comment, label or directive) */
+static bool_t is_code(line_t *line)
+{
+    return line->type == TYPE_INS && line->inst != NULL &&
+           ICODE(line) != I_DIRECTIVE;
+}
+
+/* is_zero_move: the line is 'irmovq $0, %reg' */
+static bool_t is_zero_move(line_t *line)
+{
+    int i;
+    if (!is_code(line) || ICODE(line) != I_IRMOVQ || line->reloc != NULL)
+        return FALSE;
+    for (i = 2; i < 10; i++)
+        if (line->y64bin.codes[i] != 0)
+            return FALSE;
+    return TRUE;
+}
+
+/* is_self_xor: the line is 'xorq %reg, %reg' */
+static bool_t is_self_xor(line_t *line)
+{
+    return is_code(line) && line->inst->code == HPACK(I_ALU, A_XOR) &&
+           RA(line) == RB(line);
+}
+
+/* drop_line: remove the code of a line, but keep the label defined on it */
+static void drop_line(line_t *line)
+{
+    memset(line->y64bin.codes, 0, sizeof(line->y64bin.codes));
+    line->y64bin.bytes = 0;
+    line->inst = NULL;
+    if (line->label == NULL)
+        line->type = TYPE_COMM;
+}
+
+/*
+ * next_code: the instruction executed after 'line' falls through
+ * args
+ *     labeled: set to TRUE if a label is passed on the way (or NULL)
+ *
+ * return
+ *     the line of the instruction, or NULL if a directive (or end) comes first
+ */
+static line_t *next_code(line_t *line, bool_t *labeled)
+{
+    for (line = line->next; line != NULL; line = line->next) {
+        if (line->type != TYPE_INS)
+            continue;
+        if (labeled && line->label)
+            *labeled = TRUE;
+        if (line->inst == NULL)
+            continue;
+        return is_code(line) ? line : NULL;
+    }
+    return NULL;
+}
+
+/* label_code: the instruction a jump to 'name' lands on, or NULL */
+static line_t *label_code(char *name)
+{
+    symbol_t *sym = find_symbol(name);
+    if (sym == NULL)
+        return NULL;
+    if (is_code(sym->line))
+        return sym->line;
+    if (sym->line->inst != NULL)
+        return NULL;
+    return next_code(sym->line, NULL);
+}
+
+/* flags_dead: the flags are set again before any use after 'line' */
+static bool_t flags_dead(line_t *line)
+{
+    int n;
+    for (n = 0; n < OPT_MAXSCAN; n++) {
+        line = next_code(line, NULL);
+        if (line == NULL)
+            return FALSE;
+        switch (ICODE(line)) {
+          case I_ALU:
+          case I_HALT:
+            return TRUE;
+          case I_RRMOVQ:
+            if (IFUN(line) != C_YES)
+                return FALSE;
+            break;
+          case I_JMP:
+          case I_CALL:
+          case I_RET:
+            return FALSE;
+          default:
+            break;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * optimize_lines: apply the peephole rules until nothing changes
+ *     rrmovq %r,%r (or cmovXX %r,%r)    => removed
+ *     irmovq $0,%r + xorq %r,%r          => xorq %r,%r
+ *     xorq %r,%r + irmovq $0,%r          => xorq %r,%r
+ *     irmovq $0,%r (flags dead after it) => xorq %r,%r
+ *     jXX/call L, L: jmp M               => jXX/call M
+ *     jXX L, where L is next instruction => removed
+ *     code after jmp/ret/halt until a label or directive => removed
+ */
+void optimize_lines(void)
+{
+    line_t *line, *next;
+    reloc_t *rtmp;
+    int pass, changed, hops;
+    bool_t labeled;
+
+    for (pass = 0; pass < OPT_MAXPASS; pass++) {
+        changed = 0;
+        for (line = as->line_head->next; line != NULL; line = line->next) {
+            if (!is_code(line))
+                continue;
+
+            /* self moves */
+            if (ICODE(line) == I_RRMOVQ && RA(line) == RB(line)) {
+                drop_line(line);
+                changed++;
+                continue;
+            }
+
+            /* zeroing twice */
+            labeled = FALSE;
+            next = next_code(line, &labeled);
+            if (is_zero_move(line) && next && is_self_xor(next) &&
+                RB(line) == RB(next)) {
+                drop_line(line);
+                changed++;
+                continue;
+            }
+            if (is_self_xor(line) && next && !labeled && is_zero_move(next) &&
+                RB(line) == RB(next)) {
+                drop_line(next);
+                changed++;
+            }
+
+            /* thread jumps to jumps */
+            if ((ICODE(line) == I_JMP || ICODE(line) == I_CALL) && line->reloc) {
+                char *name = line->reloc->name;
+                line_t *target;
+                for (hops = 0; hops < OPT_MAXHOPS; hops++) {
+                    target = label_code(name);
+                    if (target == NULL || target == line || ICODE(target) != I_JMP ||
+                        IFUN(target) != C_YES || target->reloc == NULL ||
+                        !strcmp(target->reloc->name, name))
+                        break;
+                    name = target->reloc->name;
+                }
+                if (name != line->reloc->name) {
+                    line->reloc->name = name;
+                    changed++;
+                }
+            }
+
+            /* jumps to next instruction */
+            if (ICODE(line) == I_JMP && line->reloc &&
+                next != NULL && label_code(line->reloc->name) == next) {
+                drop_line(line);
+                changed++;
+                continue;
+            }
+
+            /* unreachable code */
+            if ((ICODE(line) == I_JMP && IFUN(line) == C_YES) ||
+                ICODE(line) == I_RET || ICODE(line) == I_HALT) {
+                for (next = line->next; next != NULL; next = next->next) {
+                    if (next->type == TYPE_COMM)
+                        continue;
+                    if (next->label || !is_code(next))
+                        break;
+                    drop_line(next);
+                    changed++;
+                }
+            }
+        }
+
+        /* irmovq $0 is 10 bytes, xorq 2, but xorq also sets the flags */
+        for (line = as->line_head->next; line != NULL; line = line->next) {
+            if (is_zero_move(line) && flags_dead(line)) {
+                regid_t reg = RB(line);
+                line->inst = find_instr("xorq", 4);
+                line->y64bin.codes[0] = line->inst->code;
+                line->y64bin.codes[1] = HPACK(reg, reg);
+                memset(line->y64bin.codes + 2, 0, 8);
+                line->y64bin.bytes = line->inst->bytes;
+                changed++;
+            }
+        }
+
+        if (!changed)
+            break;
+    }
+
+    /* forget relocations of removed code */
+    rtmp = as->reltab;
+    while (rtmp->next) {
+        if (rtmp->next->line->inst == NULL)
+            rtmp->next = rtmp->next->next;
+        else
+            rtmp = rtmp->next;
+    }
+    as->reltab_tail = rtmp;
+
+    /* lay out the lines again, like parse_line does */
+    as->vmaddr = 0;
+    for (line = as->line_head->next; line != NULL; line = line->next) {
+        if (line->type != TYPE_INS)
+            continue;
+        if (line->label)
+            line->label->addr = as->vmaddr;
+        if (line->inst && line->inst->code == HPACK(I_DIRECTIVE, D_POS)) {
+            as->vmaddr = line->y64bin.addr;
+        } else if (line->inst && line->inst->code == HPACK(I_DIRECTIVE, D_ALIGN)) {
+            long value;
+            memcpy(&value, line->y64bin.codes, sizeof(long));
+            if (as->vmaddr % value != 0)
+                as->vmaddr = as->vmaddr + (value - as->vmaddr % value);
+            line->y64bin.addr = as->vmaddr;
+        } else {
+            line->y64bin.addr = as->vmaddr;
+            as->vmaddr += line->y64bin.bytes;
+        }
+    }
+}
+
+/*
+ * relocate: relocate the raw y64 binary code with symbol address
+ *
+ * return
+ *     0: success
+ *     -1: error, try to print err information (e.g., addr and symbol)
+ */
+int relocate(void)
+{
+    reloc_t *rtmp = NULL;
+    rtmp = as->reltab->next;
+    while (rtmp) {
+        /* find symbol (left to y64ld if relocatable) */
+        symbol_t *tempsym = find_symbol(rtmp->name);
+        if (tempsym == NULL && as->relocatable) {
+          rtmp = rtmp->next;
+          continue;
+        }
+        if (tempsym == NULL) {
+          err_print("Unknown symbol:'%s'", rtmp->name);
+          return -1;
+        }
+
+        /* relocate y64bin according itype */
+        int pos;
+        switch (HIGH(rtmp->line->inst->code)) {
+          case I_IRMOVQ:
+          case I_JMP:
+          case I_CALL:
+            pos = rtmp->y64bin->bytes - 8;
+            memcpy(rtmp->y64bin->codes + pos, (void *)&tempsym->addr, 8);
+            break;
+          case I_DIRECTIVE:
+
+            if (rtmp->y64bin->bytes == 1) {
+              pos = rtmp->y64bin->bytes - 1;
+              memcpy(rtmp->y64bin->codes + pos, (void *)&tempsym->addr, 1);
+            }else if(rtmp->y64bin->bytes == 2){
+              pos = rtmp->y64bin->bytes - 2;
+              memcpy(rtmp->y64bin->codes + pos, (void *)&tempsym->addr, 2);
+            }else if(rtmp->y64bin->bytes == 4){
+              pos = rtmp->y64bin->bytes - 4;
+              memcpy(rtmp->y64bin->codes + pos, (void *)&tempsym->addr, 4);
+            }else if(rtmp->y64bin->bytes == 8){
+              pos = rtmp->y64bin->bytes - 8;
+              memcpy(rtmp->y64bin->codes + pos, (void *)&tempsym->addr, 8);
+            }
+        }
+
+        /* next */
+        rtmp = rtmp->next;
+    }
+    return 0;
+}
+
+/*
+ * write_iov: write all 'cnt' buffers of 'iov' to 'fd', retrying short writes
+ *
+ * return
+ *     0: success
+ *     -1: error
+ */
+static int write_iov(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0)
+            return -1;
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (byte_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* whether print the readable output to screen or not ? */
+bool_t screen = FALSE; 
+bool_t listfile = FALSE;    /* -l: listing to file.yo instead of screen */
+bool_t symmap = FALSE;      /* -m: symbol map to file.map */
+
+/*
+ * listing (.yo): lines are formatted into 'list_buf' and written out in
+ * big chunks. binfile emits it in the same walk over lines as .bin when
+ * 'list_fd' is set, otherwise print_screen does it afterwards.
+ */
+#define LIST_BUFSIZE (64 * 1024)
+#define LIST_PREFIX 32  /* "  0xHHH: " + 20 hex digits + " | " */
+
+static void hexstuff(char *dest, int value, int len)
+{
+    int i;
+    for (i = 0; i < len; i++) {
+        char c;
+        int h = (value >> 4*i) & 0xF;
+        c = h < 10 ? h + '0' : h - 10 + 'a';
+        dest[len-i-1] = c;
+    }
+}
+
+/* list_flush: write out the buffered listing */
+static int list_flush(int fd)
+{
+    struct iovec iov;
+
+    iov.iov_base = as->list_buf;
+    iov.iov_len = as->list_used;
+    as->list_used = 0;
+    return write_iov(fd, &iov, 1);
+}
+
+/*
+ * list_line: append the listing of a line to the buffer
+ * (line format: 0xHHH: cccccccccccc | <line>)
+ *
+ * return
+ *     0: success
+ *     -1: error, failed to flush the buffer
+ */
+static int list_line(int fd, line_t *line)
+{
+    size_t need = LIST_PREFIX + line->asmlen + 1;
+    char *buf;
+
+    if (as->list_buf == NULL)
+        as->list_buf = (char *)arena_alloc(LIST_BUFSIZE);
+    if (as->list_used + need > LIST_BUFSIZE && list_flush(fd) < 0)
+        return -1;
+
+    buf = as->list_buf + as->list_used;
+    memset(buf, ' ', LIST_PREFIX);
+    buf[LIST_PREFIX-2] = '|';
+    if (line->type == TYPE_INS) {
+        bin_t *y64bin = &line->y64bin;
+        int i;
+
+        buf[2] = '0';
+        buf[3] = 'x';
+        hexstuff(buf+4, y64bin->addr, 3);
+        buf[7] = ':';
+        for (i = 0; i < y64bin->bytes; i++)
+            hexstuff(buf+9+2*i, y64bin->codes[i]&0xFF, 2);
+    }
+    as->list_used += LIST_PREFIX;
+
+    /* a line longer than the whole buffer goes straight out */
+    if (need > LIST_BUFSIZE) {
+        struct iovec iov[2];
+        if (list_flush(fd) < 0)
+            return -1;
+        iov[0].iov_base = line->y64asm;
+        iov[0].iov_len = line->asmlen;
+        iov[1].iov_base = "\n";
+        iov[1].iov_len = 1;
+        return write_iov(fd, iov, 2);
+    }
+    memcpy(as->list_buf + as->list_used, line->y64asm, line->asmlen);
+    as->list_used += line->asmlen;
+    as->list_buf[as->list_used++] = '\n';
+    return 0;
+}
+
+/* list_end: the listing emitted by binfile is complete */
+static int list_end(void)
+{
+    if (as->list_fd < 0)
+        return 0;
+    as->list_done = TRUE;
+    return list_flush(as->list_fd);
+}
+
+/* 
+ * print_screen: dump readable binary and assembly code to 'fd'
+ * (e.g., Figure 4.8 in ICS book)
+ *
+ * return
+ *     0: success
+ *     -1: error
+ */
+int print_screen(int fd)
+{
+    line_t *tmp;
+    for (tmp = as->line_head->next; tmp != NULL; tmp = tmp->next)
+        if (list_line(fd, tmp) < 0)
+            return -1;
+    return list_flush(fd);
+}
+
+/*
+ * mapfile: generate the symbol map file (one 'name 0xaddr' line per label)
+ * for the simulator and debugger
+ *
+ * return
+ *     0: success
+ *     -1: error
+ */
+int mapfile(FILE *out)
+{
+    symbol_t *stmp;
+    for (stmp = as->symtab->next; stmp != NULL; stmp = stmp->next)
+        fprintf(out, "%s 0x%llx\n", stmp->name, (unsigned long long)stmp->addr);
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+ * skip_gap: move the output 'len' bytes forward, leaving a hole if the
+ * output is seekable, or writing zeros if it is a pipe
+ */
+static int skip_gap(int fd, int64_t len)
+{
+    static const byte_t zeros[4096];
+    struct iovec iov;
+
+    if (lseek(fd, len, SEEK_CUR) >= 0)
+        return 0;
+    while (len > 0) {
+        iov.iov_base = (void *)zeros;
+        iov.iov_len = len < (int64_t)sizeof(zeros) ? len : sizeof(zeros);
+        if (write_iov(fd, &iov, 1) < 0)
+            return -1;
+        len -= sizeof(zeros);
+    }
+    return 0;
+}
+
+/*
+ * binfile: generate the y64 binary file
+ * (the code of each line is streamed straight from line_t with writev,
+ *  and gaps between lines, e.g. after .pos, are seeked over, so there is
+ *  no image buffer and no zero-filling of gaps)
+ * args
+ *     out: point to output file (an y64 binary file)
+ *
+ * return
+ *     0: success
+ *     -1: error
+ */
+#define BIN_IOVMAX 1024
+
+int binfile(FILE *out)
+{
+    struct iovec iov[BIN_IOVMAX];
+    int niov = 0;
+    int fd = fileno(out);
+    off_t base;
+    int64_t pos = 0; /* image offset where the next iov goes */
+    int64_t filesize = 0;
+    line_t *tmp;
+
+    /* the image starts at current offset (after the tables of a .o file) */
+    fflush(out);
+    base = lseek(fd, 0, SEEK_CUR);
+
+    for (tmp = as->line_head->next; tmp != NULL; tmp = tmp->next) {
+        bin_t *y64bin = &tmp->y64bin;
+        bool_t code = (tmp->type == TYPE_INS && y64bin->bytes > 0);
+
+        /* a line placed before the end of last one, e.g. after '.pos' back */
+        if (code && y64bin->addr < pos)
+            break;
+
+        if (as->list_fd >= 0 && list_line(as->list_fd, tmp) < 0)
+            return -1;
+        if (!code)
+            continue;
+
+        if (y64bin->addr > pos || niov == BIN_IOVMAX) {
+            if (write_iov(fd, iov, niov) < 0)
+                return -1;
+            niov = 0;
+            if (y64bin->addr > pos && skip_gap(fd, y64bin->addr - pos) < 0)
+                return -1;
+            pos = y64bin->addr;
+        }
+        iov[niov].iov_base = y64bin->codes;
+        iov[niov].iov_len = y64bin->bytes;
+        niov++;
+        pos += y64bin->bytes;
+    }
+    if (write_iov(fd, iov, niov) < 0)
+        return -1;
+    if (tmp == NULL)
+        return list_end();
+
+    /*
+     * out of order lines: write every remaining line at its address (later
+     * lines overwrite earlier ones), the file ends with the last line
+     */
+    if (base < 0) {
+        err_print("Out of order code needs a seekable output");
+        return -1;
+    }
+    for (; tmp != NULL; tmp = tmp->next) {
+        bin_t *y64bin = &tmp->y64bin;
+        if (as->list_fd >= 0 && list_line(as->list_fd, tmp) < 0)
+            return -1;
+        if (tmp->type != TYPE_INS || y64bin->bytes == 0)
+            continue;
+        if (pwrite(fd, y64bin->codes, y64bin->bytes, base + y64bin->addr) < 0)
+            return -1;
+        filesize = y64bin->addr + y64bin->bytes;
+    }
+    if (ftruncate(fd, base + filesize) < 0)
+        return -1;
+    lseek(fd, 0, SEEK_END);
+    return list_end();
+}
+
+/*
+ * objfile: generate the y64 relocatable object file (see obj_header_t)
+ * args
+ *     out: point to output file (an y64 object file)
+ *
+ * return
+ *     0: success
+ *     -1: error
+ */
+int objfile(FILE *out)
+{
+    obj_header_t hdr;
+    obj_symbol_t osym;
+    obj_reloc_t orel;
+    symbol_t *stmp;
+    reloc_t *rtmp;
+    global_t *gtmp;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = OBJ_MAGIC;
+    for (gtmp = as->globals; gtmp != NULL; gtmp = gtmp->next) {
+        stmp = find_symbol(gtmp->name);
+        if (stmp == NULL) {
+            err_print("Undefined global symbol:%s", gtmp->name);
+            return -1;
+        }
+        if (!stmp->global) {
+            stmp->global = TRUE;
+            hdr.nsym++;
+        }
+    }
+    for (stmp = as->symtab->next; stmp != NULL; stmp = stmp->next)
+        if (stmp->addr > hdr.extent)
+            hdr.extent = stmp->addr;
+    for (rtmp = as->reltab->next; rtmp != NULL; rtmp = rtmp->next)
+        hdr.nreloc++;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    /* only the .global labels are visible to other files */
+    for (stmp = as->symtab->next; stmp != NULL; stmp = stmp->next) {
+        if (!stmp->global)
+            continue;
+        memset(&osym, 0, sizeof(osym));
+        osym.addr = stmp->addr;
+        osym.namelen = strlen(stmp->name);
+        fwrite(&osym, sizeof(osym), 1, out);
+        fwrite(stmp->name, osym.namelen, 1, out);
+    }
+
+    /* the field of an instruction is its last 8 bytes, a data directive is all field */
+    for (rtmp = as->reltab->next; rtmp != NULL; rtmp = rtmp->next) {
+        bin_t *y64bin = rtmp->y64bin;
+        memset(&orel, 0, sizeof(orel));
+        if (HIGH(rtmp->line->inst->code) == I_DIRECTIVE) {
+            orel.offset = y64bin->addr;
+            orel.bytes = y64bin->bytes;
+        } else {
+            orel.offset = y64bin->addr + y64bin->bytes - 8;
+            orel.bytes = 8;
+        }
+        orel.type = find_symbol(rtmp->name) ? R_LOCAL : R_EXTERN;
+        orel.namelen = strlen(rtmp->name);
+        fwrite(&orel, sizeof(orel), 1, out);
+        fwrite(rtmp->name, orel.namelen, 1, out);
+    }
+
+    /* image up to the end of file */
+    return binfile(out);
+}
+
+/*
+ * incremental reassembly (y64asm -i): the per-line encodings, addresses,
+ * labels and relocations of the last run are kept in file.yc, so only the
+ * lines between the unchanged head and tail of the source are parsed again
+ */
+
+/* names of a cache record are right after it */
+#define CACHE_LABEL(r) ((r)->labellen ? (char *)((r) + 1) : NULL)
+#define CACHE_RELNAME(r) ((r)->relnamelen ? \
+    (char *)((r) + 1) + ((r)->labellen ? (r)->labellen + 1 : 0) : NULL)
+
+/* cache_reclen: size of a cache record with its names and padding */
+static size_t cache_reclen(uint32_t labellen, uint32_t relnamelen)
+{
+    size_t len = sizeof(cache_line_t);
+    if (labellen)
+        len += labellen + 1;
+    if (relnamelen)
+        len += relnamelen + 1;
+    return (len + 7) & ~(size_t)7;
+}
+
+/*
+ * load_cache: map the cache file of last run
+ *
+ * return
+ *     0: success
+ *     -1: error, the cache is missing or broken and should be ignored
+ */
+int load_cache(FILE *cf)
+{
+    struct stat st;
+    cache_header_t hdr;
+    byte_t *cur, *end;
+    uint32_t i, nlabel = 0;
+
+    if (fstat(fileno(cf), &st) < 0 || st.st_size < (off_t)sizeof(hdr))
+        return -1;
+    as->cache_len = st.st_size;
+    as->cache_buf = mmap(NULL, as->cache_len, PROT_READ, MAP_PRIVATE, fileno(cf), 0);
+    if (as->cache_buf == MAP_FAILED) {
+        as->cache_buf = NULL;
+        return -1;
+    }
+    memcpy(&hdr, as->cache_buf, sizeof(hdr));
+    if (hdr.magic != CACHE_MAGIC)
+        return -1;
+
+    as->old_lines = (cache_line_t **)arena_alloc(sizeof(cache_line_t *) * (hdr.nlines + 1));
+    cur = as->cache_buf + sizeof(hdr);
+    end = as->cache_buf + as->cache_len;
+    for (i = 0; i < hdr.nlines; i++) {
+        cache_line_t *rec = (cache_line_t *)cur;
+        if (cur + sizeof(cache_line_t) > end)
+            return -1;
+        cur += cache_reclen(rec->labellen, rec->relnamelen);
+        if (cur > end)
+            return -1;
+        if (rec->labellen)
+            nlabel++;
+        as->old_lines[i] = rec;
     }
 
-    /* binary write y64 code to output file (NOTE: see fwrite()) */
-    fwrite(image, filesize, 1, out);
-    free(image);
+    /* the labels will mostly be added again, size the index once for them */
+    symhash_reserve(nlabel);
+    as->old_nlines = hdr.nlines;
+    as->cache_hdr = hdr;
     return 0;
 }
 
+/* reuse_line: take the cached encoding and label of an unchanged line */
+static int reuse_line(incr_line_t *nl, cache_line_t *rec)
+{
+    nl->rec = *rec;
+    nl->label = CACHE_LABEL(rec);
+    nl->relname = CACHE_RELNAME(rec);
+    nl->line->type = rec->type;
+    nl->line->y64bin = rec->y64bin;
+    nl->line->inst = rec->inst >= 0 ? &instr_set[rec->inst] : NULL;
+
+    if (nl->label) {
+        if (add_symbol(nl->label) == -1) {
+            nl->line->type = TYPE_ERR;
+            return -1;
+        }
+        as->symtab_tail->addr = rec->labeladdr;
+        as->symtab_tail->line = nl->line;
+        nl->line->label = as->symtab_tail;
+    }
+    as->vmaddr = rec->vmaddr;
+    return 0;
+}
 
-/* whether print the readable output to screen or not ? */
-bool_t screen = FALSE; 
+/* encode_line: parse a changed line, and remember its label and relocation */
+static int encode_line(incr_line_t *nl)
+{
+    symbol_t *stail = as->symtab_tail;
+    reloc_t *rtail = as->reltab_tail;
+
+    if (parse_line(nl->line) == TYPE_ERR)
+        return -1;
+    if (as->symtab_tail != stail) {
+        nl->label = as->symtab_tail->name;
+        nl->rec.labeladdr = as->symtab_tail->addr;
+    }
+    if (as->reltab_tail != rtail)
+        nl->relname = as->reltab_tail->name;
+    nl->rec.vmaddr = as->vmaddr;
+    nl->dirty = TRUE;
+    return 0;
+}
 
-static void hexstuff(char *dest, int value, int len)
+/*
+ * assemble_incr: like assemble, but reuse the lines cached in last run
+ * args
+ *     in: point to input file (an y64 assembly file)
+ *     cf: point to cache file, or NULL if there is none
+ *
+ * return
+ *     0: success, assmble the y64 file to a list of line_t
+ *     -1: error, try to print err information (e.g., instr type and line number)
+ */
+int assemble_incr(FILE *in, FILE *cf)
 {
-    int i;
-    for (i = 0; i < len; i++) {
-        char c;
-        int h = (value >> 4*i) & 0xF;
-        c = h < 10 ? h + '0' : h - 10 + 'a';
-        dest[len-i-1] = c;
+    char *cur, *end;
+    uint32_t i, n, head, tail, oi;
+    int64_t tailaddr;
+    bool_t reuse_tail;
+
+    if (map_source(in) < 0)
+        return -1;
+    if (cf == NULL || load_cache(cf) < 0)
+        as->old_nlines = 0;
+
+    /* count and split lines */
+    n = 0;
+    end = as->src_buf + as->src_len;
+    for (cur = as->src_buf; cur < end; n++) {
+        cur = memchr(cur, '\n', end - cur);
+        cur = cur ? cur + 1 : end;
+    }
+    as->new_lines = (incr_line_t *)arena_alloc(sizeof(incr_line_t) * (n + 1));
+    as->new_nlines = n;
+    cur = as->src_buf;
+    for (i = 0; i < n; i++) {
+        as->new_lines[i].line = new_line(&cur);
+        as->new_lines[i].rec.hash = hash_span(as->new_lines[i].line->y64asm,
+                                          as->new_lines[i].line->asmlen);
+        /* expansions don't map to source lines, so they can't be cached */
+        char *ptr = as->new_lines[i].line->y64asm;
+        if (pp_directive(&ptr, ptr + as->new_lines[i].line->asmlen) != PP_NONE) {
+            as->lineno = i + 1;
+            err_print("Macros, .rept and .set are not supported with -i");
+            return -1;
+        }
+    }
+
+    /* the unchanged head and tail of source */
+    head = 0;
+    while (head < n && head < as->old_nlines &&
+           as->new_lines[head].rec.hash == as->old_lines[head]->hash)
+        head++;
+    tail = 0;
+    while (tail < n - head && tail < as->old_nlines - head &&
+           as->new_lines[n-1-tail].rec.hash == as->old_lines[as->old_nlines-1-tail]->hash)
+        tail++;
+
+    /* head lines: the cache is valid as is */
+    as->vmaddr = 0;
+    for (i = 0; i < head; i++) {
+        as->lineno = i + 1;
+        if (reuse_line(&as->new_lines[i], as->old_lines[i]) < 0)
+            return -1;
+    }
+
+    /* changed lines */
+    for (i = head; i < n - tail; i++) {
+        as->lineno = i + 1;
+        if (encode_line(&as->new_lines[i]) < 0)
+            return -1;
+    }
+
+    /* tail lines: the cache is valid only if they start at the same vmaddr */
+    oi = as->old_nlines - tail;
+    tailaddr = oi > 0 ? as->old_lines[oi-1]->vmaddr : 0;
+    reuse_tail = (tailaddr == as->vmaddr);
+    as->same_layout = (reuse_tail && n == as->old_nlines);
+    for (i = n - tail; i < n; i++, oi++) {
+        as->lineno = i + 1;
+        if (reuse_tail) {
+            if (reuse_line(&as->new_lines[i], as->old_lines[oi]) < 0)
+                return -1;
+        } else if (encode_line(&as->new_lines[i]) < 0) {
+            return -1;
+        }
+    }
+
+    /* changed lines must keep address and size to patch .bin in place */
+    for (i = head; as->same_layout && i < n - tail; i++) {
+        bin_t *nb = &as->new_lines[i].line->y64bin;
+        bin_t *ob = &as->old_lines[i]->y64bin;
+        if (as->new_lines[i].line->type != as->old_lines[i]->type ||
+            nb->addr != ob->addr || nb->bytes != ob->bytes)
+            as->same_layout = FALSE;
+    }
+
+    /*
+     * rebuild relocation table in line order: changed lines, and reused
+     * lines only if their symbol moved (or is gone)
+     */
+    as->reltab->next = NULL;
+    as->reltab_tail = as->reltab;
+    for (i = 0; i < n; i++) {
+        incr_line_t *nl = &as->new_lines[i];
+        symbol_t *sym;
+        if (nl->relname == NULL)
+            continue;
+        if (!nl->dirty) {
+            sym = find_symbol(nl->relname);
+            if (sym != NULL && sym->addr == nl->rec.relvalue)
+                continue;
+            nl->dirty = TRUE;
+        }
+        add_reloc(nl->relname, nl->line);
     }
+
+    as->lineno = -1;
+    return 0;
 }
 
-void print_line(line_t *line)
+/* incr_binsize: size of .bin image, the end of the last line with code */
+static int64_t incr_binsize(void)
 {
-    char buf[64];
+    int64_t size = 0;
+    uint32_t i;
+    for (i = 0; i < as->new_nlines; i++) {
+        line_t *line = as->new_lines[i].line;
+        if (line->type == TYPE_INS && line->y64bin.bytes > 0)
+            size = line->y64bin.addr + line->y64bin.bytes;
+    }
+    return size;
+}
 
-    /* line format: 0xHHH: cccccccccccc | <line> */
-    if (line->type == TYPE_INS) {
-        bin_t *y64bin = &line->y64bin;
-        int i;
-        
-        strcpy(buf, "  0x000:                      | ");
-        hexstuff(buf+4, y64bin->addr, 3);
-        if (y64bin->bytes > 0)
-            for (i = 0; i < y64bin->bytes; i++)
-                hexstuff(buf+9+2*i, y64bin->codes[i]&0xFF, 2);
-    } else {
-        strcpy(buf, "                              | ");
+/*
+ * bin_ident: put the size, inode and mtime of the .bin file into 'hdr'
+ *
+ * return
+ *     0: success
+ *     -1: error, the file can't be stat'ed
+ */
+static int bin_ident(char *binfname, cache_header_t *hdr)
+{
+    struct stat st;
+
+    if (stat(binfname, &st) < 0)
+        return -1;
+    hdr->binsize = st.st_size;
+    hdr->binino = st.st_ino;
+    hdr->binmtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/*
+ * patch_binfile: rewrite only the dirty lines of an existing .bin file
+ * args
+ *     outfname: name of the y64 binary file
+ *
+ * return
+ *     1: success, the file is up to date
+ *     0: the layout changed, or the file isn't the one the cache belongs
+ *        to, the whole file has to be generated
+ */
+int patch_binfile(char *outfname)
+{
+    cache_header_t cur;
+    FILE *out;
+    uint32_t i;
+
+    if (!as->same_layout || as->cache_hdr.magic != CACHE_MAGIC ||
+        incr_binsize() != as->cache_hdr.binsize)
+        return 0;
+    if (bin_ident(outfname, &cur) < 0 ||
+        cur.binsize != as->cache_hdr.binsize ||
+        cur.binino != as->cache_hdr.binino ||
+        cur.binmtime != as->cache_hdr.binmtime)
+        return 0;
+    out = fopen(outfname, "r+b");
+    if (!out)
+        return 0;
+
+    for (i = 0; i < as->new_nlines; i++) {
+        line_t *line = as->new_lines[i].line;
+        if (!as->new_lines[i].dirty || line->type != TYPE_INS || line->y64bin.bytes == 0)
+            continue;
+        fseek(out, line->y64bin.addr, SEEK_SET);
+        fwrite(line->y64bin.codes, line->y64bin.bytes, 1, out);
     }
+    fclose(out);
+    return 1;
+}
 
-    printf("%s%s\n", buf, line->y64asm);
+/* fill_cache_rec: bring the cache record of a line up to date */
+static void fill_cache_rec(incr_line_t *nl)
+{
+    nl->rec.type = nl->line->type;
+    nl->rec.y64bin = nl->line->y64bin;
+    nl->rec.inst = nl->line->inst ? nl->line->inst - instr_set : -1;
+    nl->rec.labellen = nl->label ? strlen(nl->label) : 0;
+    nl->rec.relnamelen = nl->relname ? strlen(nl->relname) : 0;
+    if (nl->relname)
+        nl->rec.relvalue = find_symbol(nl->relname)->addr;
 }
 
-/* 
- * print_screen: dump readable binary and assembly code to screen
- * (e.g., Figure 4.8 in ICS book)
+/* write_cache_rec: write the cache record of a line with its names and padding */
+static void write_cache_rec(FILE *out, incr_line_t *nl)
+{
+    static const byte_t pad[8];
+    size_t len = sizeof(cache_line_t);
+
+    fwrite(&nl->rec, sizeof(cache_line_t), 1, out);
+    if (nl->label) {
+        fwrite(nl->label, nl->rec.labellen + 1, 1, out);
+        len += nl->rec.labellen + 1;
+    }
+    if (nl->relname) {
+        fwrite(nl->relname, nl->rec.relnamelen + 1, 1, out);
+        len += nl->rec.relnamelen + 1;
+    }
+    fwrite(pad, cache_reclen(nl->rec.labellen, nl->rec.relnamelen) - len, 1, out);
+}
+
+/*
+ * patch_cachefile: rewrite only the records of dirty lines in the cache
+ * file, and the header for the .bin file as it is now
+ * args
+ *     cachefname: name of the y64 cache file
+ *     binfname: name of the y64 binary file
+ *
+ * return
+ *     1: success, the file is up to date
+ *     0: some record changed its size, the whole file has to be generated
+ */
+int patch_cachefile(char *cachefname, char *binfname)
+{
+    cache_header_t hdr = as->cache_hdr;
+    FILE *out;
+    uint32_t i;
+
+    if (!as->same_layout || as->cache_buf == NULL)
+        return 0;
+    for (i = 0; i < as->new_nlines; i++) {
+        incr_line_t *nl = &as->new_lines[i];
+        if (!nl->dirty)
+            continue;
+        fill_cache_rec(nl);
+        if (cache_reclen(nl->rec.labellen, nl->rec.relnamelen) !=
+            cache_reclen(as->old_lines[i]->labellen, as->old_lines[i]->relnamelen))
+            return 0;
+    }
+
+    out = fopen(cachefname, "r+b");
+    if (!out)
+        return 0;
+    for (i = 0; i < as->new_nlines; i++) {
+        if (!as->new_lines[i].dirty)
+            continue;
+        fseek(out, (byte_t *)as->old_lines[i] - as->cache_buf, SEEK_SET);
+        write_cache_rec(out, &as->new_lines[i]);
+    }
+    if (bin_ident(binfname, &hdr) < 0)
+        hdr.binsize = -1;
+    fseek(out, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    fclose(out);
+    return 1;
+}
+
+/*
+ * cachefile: generate the cache file for next run
+ * args
+ *     out: point to output file (an y64 cache file)
+ *     binfname: name of the y64 binary file the cache belongs to
+ *
+ * return
+ *     0: success
+ *     -1: error
  */
-void print_screen(void)
+int cachefile(FILE *out, char *binfname)
 {
-    line_t *tmp = line_head->next;
-    while (tmp != NULL) {
-        print_line(tmp);
-        tmp = tmp->next;
+    cache_header_t hdr;
+    uint32_t i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CACHE_MAGIC;
+    hdr.nlines = as->new_nlines;
+    if (bin_ident(binfname, &hdr) < 0)
+        hdr.binsize = -1;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    for (i = 0; i < as->new_nlines; i++) {
+        fill_cache_rec(&as->new_lines[i]);
+        write_cache_rec(out, &as->new_lines[i]);
     }
+    return 0;
 }
 
-/* init and finit */
-void init(void)
+/*
+ * library interface (see y64asm.h): one context per assembly, contexts in
+ * different threads are independent; the instruction hash is built once
+ * and only read afterwards
+ */
+static pthread_once_t instrhash_once = PTHREAD_ONCE_INIT;
+
+/*
+ * y64asm_new: create an assembler context and make it the current one of
+ * this thread
+ *
+ * return
+ *     the context, or NULL if out of memory
+ */
+y64asm_t *y64asm_new(void)
 {
-    reltab = (reloc_t *)malloc(sizeof(reloc_t)); // free in finit
-    memset(reltab, 0, sizeof(reloc_t));
+    y64asm_t *ctx = (y64asm_t *)calloc(1, sizeof(y64asm_t));
+    if (ctx == NULL)
+        return NULL;
+    as = ctx;
+
+    as->reltab = (reloc_t *)arena_alloc(sizeof(reloc_t)); // free in y64asm_free
+    as->reltab_tail = as->reltab;
+
+    as->symtab = (symbol_t *)arena_alloc(sizeof(symbol_t)); // free in y64asm_free
+    as->symtab_tail = as->symtab;
 
-    symtab = (symbol_t *)malloc(sizeof(symbol_t)); // free in finit
-    memset(symtab, 0, sizeof(symbol_t));
+    as->symhash_size = SYMHASH_INIT;
+    as->symhash_used = 0;
+    as->symhash = (symbol_t **)calloc(as->symhash_size, sizeof(symbol_t *)); // free in y64asm_free
 
-    line_head = (line_t *)malloc(sizeof(line_t)); // free in finit
-    memset(line_head, 0, sizeof(line_t));
-    line_tail = line_head;
-    lineno = 0;
+    as->line_head = (line_t *)arena_alloc(sizeof(line_t)); // free in y64asm_free
+    as->line_tail = as->line_head;
+    as->lineno = 0;
+    as->list_fd = -1;
+
+    pthread_once(&instrhash_once, instrhash_init);
+    return ctx;
 }
 
-void finit(void)
+void y64asm_free(y64asm_t *ctx)
 {
-    reloc_t *rtmp = NULL;
-    do {
-        rtmp = reltab->next;
-        if (reltab->name) 
-            free(reltab->name);
-        free(reltab);
-        reltab = rtmp;
-    } while (reltab);
-    
-    symbol_t *stmp = NULL;
-    do {
-        stmp = symtab->next;
-        if (symtab->name) 
-            free(symtab->name);
-        free(symtab);
-        symtab = stmp;
-    } while (symtab);
-
-    line_t *ltmp = NULL;
-    do {
-        ltmp = line_head->next;
-        if (line_head->y64asm) 
-            free(line_head->y64asm);
-        free(line_head);
-        line_head = ltmp;
-    } while (line_head);
+    if (ctx == NULL)
+        return;
+    as = ctx;
+
+    /* lines, symbols, relocations and names all live in the arena */
+    arena_free();
+    free(as->symhash);
+    free(as->consthash.slot);
+    free(as->macrohash.slot);
+    if (as->cache_buf)
+        munmap(as->cache_buf, as->cache_len);
+
+    if (as->src_buf) {
+        if (as->src_maplen)
+            munmap(as->src_buf, as->src_maplen);
+        else
+            free(as->src_buf);
+    }
+    free(ctx);
+    as = NULL;
+}
+
+/*
+ * y64asm_assemble: assemble the 'len' chars of y64 code at 'src' (need
+ * not be NUL-terminated), then optimize (if Y64ASM_OPTIMIZE) and relocate,
+ * a context assembles only once
+ *
+ * return
+ *     0: success
+ *     -1: error, err information is printed to stderr
+ */
+int y64asm_assemble(y64asm_t *ctx, const char *src, size_t len, int flags)
+{
+    as = ctx;
+    as->optimize = (flags & Y64ASM_OPTIMIZE) != 0;
+
+    /* a private copy, with the zero byte the lexer may read at its end */
+    as->src_buf = (char *)malloc(len + 1);
+    if (as->src_buf == NULL) {
+        err_print("Out of memory");
+        return -1;
+    }
+    memcpy(as->src_buf, src, len);
+    as->src_buf[len] = '\0';
+    as->src_len = len;
+    as->src_maplen = 0;
+
+    if (assemble_lines() < 0)
+        return -1;
+    if (as->optimize)
+        optimize_lines();
+    return relocate();
+}
+
+/*
+ * y64asm_binary: the assembled image, just as binfile would write it
+ *
+ * return
+ *     the image (free it with free()), and its size is stored to 'len',
+ *     or NULL if out of memory
+ */
+byte_t *y64asm_binary(y64asm_t *ctx, size_t *len)
+{
+    line_t *tmp;
+    byte_t *bin;
+    size_t size = 0;
+
+    /* the image ends with the last line, later lines overwrite earlier ones */
+    for (tmp = ctx->line_head->next; tmp != NULL; tmp = tmp->next)
+        if (tmp->type == TYPE_INS && tmp->y64bin.bytes > 0)
+            size = tmp->y64bin.addr + tmp->y64bin.bytes;
+    bin = (byte_t *)calloc(size ? size : 1, 1);
+    if (bin == NULL)
+        return NULL;
+    for (tmp = ctx->line_head->next; tmp != NULL; tmp = tmp->next)
+        if (tmp->type == TYPE_INS && tmp->y64bin.bytes > 0 &&
+            tmp->y64bin.addr + tmp->y64bin.bytes <= (int64_t)size)
+            memcpy(bin + tmp->y64bin.addr, tmp->y64bin.codes, tmp->y64bin.bytes);
+    *len = size;
+    return bin;
+}
+
+/*
+ * y64asm_symbol: look up a label of the assembled code
+ *
+ * return
+ *     the address of 'name', or -1 if there is no such label
+ */
+int64_t y64asm_symbol(y64asm_t *ctx, const char *name)
+{
+    symbol_t *sym;
+    as = ctx;
+    sym = find_symbol((char *)name);
+    return sym ? sym->addr : -1;
+}
+
+#ifndef Y64ASM_LIB
+
+/* phase timing (y64asm -t), printed to stderr */
+bool_t timing = FALSE;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void print_phase(const char *name, double secs, long nlines)
+{
+    fprintf(stderr, "%-10s %10.6f s %14.0f lines/s\n",
+            name, secs, secs > 0 ? nlines / secs : 0.0);
+}
+
+/* print_timing: the time of each phase, and peak memory of the process */
+static void print_timing(double *t, int nphase, const char **names)
+{
+    struct rusage ru;
+    line_t *tmp;
+    long nlines = 0;
+    int i;
+
+    for (tmp = as->line_head->next; tmp != NULL; tmp = tmp->next)
+        nlines++;
+    for (i = 0; i < nphase; i++)
+        if (names[i] != NULL)
+            print_phase(names[i], t[i+1] - t[i], nlines);
+    print_phase("total", t[nphase] - t[0], nlines);
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "%ld lines, peak memory %ld KB\n", nlines, ru.ru_maxrss);
 }
 
 static void usage(char *pname)
 {
-    printf("Usage: %s [-v] file.ys\n", pname);
+    printf("Usage: %s [-v] [-c] [-i] [-O] [-l] [-m] [-t] file.ys\n", pname);
     printf("   -v print the readable output to screen\n");
+    printf("   -c generate a relocatable object file.o for y64ld\n");
+    printf("   -i reassemble incrementally with the cache file.yc of last run\n");
+    printf("   -O optimize the code with peephole rules\n");
+    printf("   -l write the listing to file.yo (in the same pass as file.bin)\n");
+    printf("   -m write the symbol map file.map (name and address of labels)\n");
+    printf("   -t print the time of each phase and peak memory to stderr\n");
     exit(0);
 }
 
@@ -1009,23 +3003,59 @@ int main(int argc, char *argv[])
     int rootlen;
     char infname[512];
     char outfname[512];
+    char cachefname[512];
     int nextarg = 1;
-    FILE *in = NULL, *out = NULL;
+    FILE *in = NULL, *out = NULL, *cache = NULL;
+    const char *phases[] = {"assemble", "optimize", "relocate", "binfile"};
+    double t[5];
     
     if (argc < 2)
         usage(argv[0]);
+
+    /* init */
+    as = y64asm_new();
+    if (as == NULL) {
+        err_print("Out of memory");
+        exit(1);
+    }
     
-    if (argv[nextarg][0] == '-') {
+    while (nextarg < argc && argv[nextarg][0] == '-') {
         char flag = argv[nextarg][1];
         switch (flag) {
           case 'v':
             screen = TRUE;
             nextarg++;
             break;
+          case 'c':
+            as->relocatable = TRUE;
+            nextarg++;
+            break;
+          case 'i':
+            as->incremental = TRUE;
+            nextarg++;
+            break;
+          case 'O':
+            as->optimize = TRUE;
+            nextarg++;
+            break;
+          case 'l':
+            listfile = TRUE;
+            nextarg++;
+            break;
+          case 'm':
+            symmap = TRUE;
+            nextarg++;
+            break;
+          case 't':
+            timing = TRUE;
+            nextarg++;
+            break;
           default:
             usage(argv[0]);
         }
     }
+    if (nextarg >= argc || (as->incremental && (as->relocatable || as->optimize)))
+        usage(argv[0]);
 
     /* parse input file name */
     rootlen = strlen(argv[nextarg])-3;
@@ -1039,12 +3069,10 @@ int main(int argc, char *argv[])
     }
  
 
-    /* init */
-    init();
 
     
     /* assemble .ys file */
-    strncpy(infname, argv[nextarg], rootlen);
+    memcpy(infname, argv[nextarg], rootlen);
     strcpy(infname+rootlen, ".ys");
     in = fopen(infname, "r");
     if (!in) {
@@ -1052,44 +3080,121 @@ int main(int argc, char *argv[])
         exit(1);
     }
     
-    if (assemble(in) < 0) {
+    if (as->incremental) {
+        strncpy(cachefname, argv[nextarg], rootlen);
+        strcpy(cachefname+rootlen, ".yc");
+        cache = fopen(cachefname, "rb");
+    }
+
+    t[0] = now();
+    if ((as->incremental ? assemble_incr(in, cache) : assemble(in)) < 0) {
         err_print("Assemble y64 code error");
         fclose(in);
         exit(1);
     }
     fclose(in);
+    if (cache)
+        fclose(cache);
 
 
+    /* optimize binary code */
+    t[1] = now();
+    if (as->optimize)
+        optimize_lines();
+    else
+        phases[1] = NULL;
+    t[2] = now();
+
     /* relocate binary code */
     if (relocate() < 0) {
         err_print("Relocate binary code error");
         exit(1);
     }
+    t[3] = now();
+
+    /* the listing goes out with .bin (or .o) */
+    if (listfile) {
+        strncpy(outfname, argv[nextarg], rootlen);
+        strcpy(outfname+rootlen, ".yo");
+        as->list_fd = open(outfname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (as->list_fd < 0) {
+            err_print("Can't open listing file '%s'", outfname);
+            exit(1);
+        }
+    } else if (screen) {
+        fflush(stdout);
+        as->list_fd = STDOUT_FILENO;
+    }
 
-
-    /* generate .bin file */
+    /* generate .bin file (or .o file if relocatable) */
     strncpy(outfname, argv[nextarg], rootlen);
-    strcpy(outfname+rootlen, ".bin");
-    out = fopen(outfname, "wb");
-    if (!out) {
-        err_print("Can't open output file '%s'", outfname);
-        exit(1);
-    }
+    strcpy(outfname+rootlen, as->relocatable ? ".o" : ".bin");
+    if (!as->incremental || !patch_binfile(outfname)) {
+        out = fopen(outfname, "wb");
+        if (!out) {
+            err_print("Can't open output file '%s'", outfname);
+            exit(1);
+        }
 
-    if (binfile(out) < 0) {
-        err_print("Generate binary file error");
+        if ((as->relocatable ? objfile(out) : binfile(out)) < 0) {
+            err_print("Generate binary file error");
+            fclose(out);
+            exit(1);
+        }
         fclose(out);
-        exit(1);
     }
-    fclose(out);
+    t[4] = now();
+    if (timing)
+        print_timing(t, 4, phases);
+
+    /*
+     * generate .yc file for next incremental run, through a new file since
+     * the reused names still point into the mapped old one
+     */
+    if (as->incremental && !patch_cachefile(cachefname, outfname)) {
+        char tmpfname[520];
+        sprintf(tmpfname, "%s.tmp", cachefname);
+        cache = fopen(tmpfname, "wb");
+        if (!cache) {
+            err_print("Can't open cache file '%s'", tmpfname);
+            exit(1);
+        }
+        cachefile(cache, outfname);
+        fclose(cache);
+        if (rename(tmpfname, cachefname) < 0) {
+            err_print("Can't write cache file '%s'", cachefname);
+            exit(1);
+        }
+    }
     
-    /* print to screen (.yo file) */
-    if (screen)
-       print_screen(); 
+    /* print to screen (.yo file), if not done with .bin */
+    if (as->list_fd >= 0 && !as->list_done && print_screen(as->list_fd) < 0) {
+        err_print("Generate listing error");
+        exit(1);
+    }
+    if (listfile)
+        close(as->list_fd);
+
+    /* generate .map file */
+    if (symmap) {
+        strncpy(outfname, argv[nextarg], rootlen);
+        strcpy(outfname+rootlen, ".map");
+        out = fopen(outfname, "w");
+        if (!out) {
+            err_print("Can't open map file '%s'", outfname);
+            exit(1);
+        }
+        if (mapfile(out) < 0) {
+            err_print("Generate map file error");
+            fclose(out);
+            exit(1);
+        }
+        fclose(out);
+    }
 
     /* finit */
-    finit();
+    y64asm_free(as);
     return 0;
 }
 
-
+#endif /* Y64ASM_LIB */
@@ -3,11 +3,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
-#define MAX_INSLEN  512
-
 typedef unsigned char byte_t;
 typedef int64_t word_t;
 typedef enum { FALSE, TRUE } bool_t;
@@ -39,7 +38,7 @@ typedef enum { A_ADD, A_SUB, A_AND, A_XOR, A_NONE } alu_t;
 typedef enum { C_YES, C_LE, C_L, C_E, C_NE, C_GE, C_G } cond_t;
 
 /* Directive code */
-typedef enum { D_DATA, D_POS, D_ALIGN } dtv_t;
+typedef enum { D_DATA, D_POS, D_ALIGN, D_GLOBAL } dtv_t;
 
 /* Pack itype and func/alu/cond/dtv into single byte */
 #define HPACK(hi,lo) ((((hi)&0xF)<<4)|((lo)&0xF))
@@ -67,7 +66,11 @@ typedef struct bin {
 typedef struct line {
     type_t type; /* TYPE_COMM: no y64bin, TYPE_INS: both y64bin and y64asm */
     bin_t y64bin;
-    char *y64asm;
+    char *y64asm; /* points into the mapped source, not NUL-terminated */
+    int asmlen;
+    instr_t *inst; /* instruction or directive of the line, or NULL */
+    struct symbol *label; /* label defined on the line, or NULL */
+    struct reloc *reloc; /* relocation of the line, or NULL */
     
     struct line *next;
 } line_t;
@@ -76,15 +79,129 @@ typedef struct line {
 typedef struct symbol {
     char *name;
     int64_t addr;
+    line_t *line; /* line defining the label */
+    bool_t global; /* exported to other files by .global */
     struct symbol *next;
 } symbol_t;
 
+/* name given to .global/.globl, the label may be defined later */
+typedef struct global {
+    char *name;
+    struct global *next;
+} global_t;
+
 /* binary code need to be relocated */
 typedef struct reloc {
     bin_t *y64bin;
+    line_t *line;
     char *name;
     struct reloc *next;
 } reloc_t;
 
+/*
+ * relocatable object file (y64asm -c), linked into a .bin by y64ld:
+ *     obj_header_t
+ *     nsym   x (obj_symbol_t, name)
+ *     nreloc x (obj_reloc_t, name)
+ *     image bytes up to the end of file
+ * names are not NUL-terminated, addresses are offsets inside the image;
+ * only the .global symbols are listed
+ */
+#define OBJ_MAGIC 0x50343659 /* "Y64P" */
+
+typedef struct obj_header {
+    uint32_t magic;
+    uint32_t nsym;
+    uint32_t nreloc;
+    uint32_t pad;
+    int64_t extent; /* highest label address, may be past the image */
+} obj_header_t;
+
+typedef struct obj_symbol {
+    int64_t addr;
+    uint32_t namelen;
+    uint32_t pad;
+} obj_symbol_t;
+
+/* R_LOCAL: field holds an image offset, add the image base when linking
+ * R_EXTERN: field is filled with the address of a symbol of another file */
+typedef enum { R_LOCAL, R_EXTERN } rtype_t;
+
+typedef struct obj_reloc {
+    int64_t offset; /* offset of the field inside the image */
+    uint32_t bytes; /* size of the field: 1, 2, 4 or 8 */
+    uint32_t type;
+    uint32_t namelen;
+    uint32_t pad;
+} obj_reloc_t;
+
+/*
+ * incremental cache file (y64asm -i), file.yc next to file.ys:
+ *     cache_header_t
+ *     nlines x (cache_line_t, label name, relocated symbol name)
+ * names are NUL-terminated and each record is padded to 8 bytes, so the
+ * mapped file is used in place
+ */
+#define CACHE_MAGIC 0x44343659 /* "Y64D" */
+
+/*
+ * the .bin the cache belongs to is patched in place only if it is still
+ * that file, unchanged since it was written: same size, inode and mtime
+ */
+typedef struct cache_header {
+    uint32_t magic;
+    uint32_t nlines;
+    int64_t binsize;  /* size of the .bin */
+    uint64_t binino;  /* inode of the .bin */
+    int64_t binmtime; /* mtime of the .bin, in ns */
+} cache_header_t;
+
+typedef struct cache_line {
+    uint64_t hash;      /* hash of the source line */
+    int64_t vmaddr;     /* vmaddr after the line */
+    bin_t y64bin;
+    int32_t type;
+    uint32_t labellen;  /* length of the label defined on the line, or 0 */
+    uint32_t relnamelen;/* length of the symbol relocated on the line, or 0 */
+    int32_t inst;       /* index of the instruction in instr_set, or -1 */
+    int64_t labeladdr;
+    int64_t relvalue;   /* address the relocated symbol had */
+} cache_line_t;
+
+/* constant defined by .set/.equ, usable in immediate expressions */
+typedef struct constant {
+    char *name;
+    int64_t value;
+} constant_t;
+
+/* a recorded line of .macro or .rept body */
+typedef struct ppline {
+    char *text; /* not NUL-terminated */
+    int len;
+    int lineno; /* source line number for err_print */
+    struct ppline *next;
+} ppline_t;
+
+#define MAX_MACRO_ARGS 16
+
+/* macro defined by .macro/.endm */
+typedef struct macro {
+    char *name;
+    int nargs;
+    char *args[MAX_MACRO_ARGS];
+    ppline_t *body;
+} macro_t;
+
+/* chunk of the bump-pointer arena that owns all assembler storage */
+typedef struct chunk {
+    struct chunk *next;
+    size_t size; /* bytes available in data[] */
+    size_t used; /* bytes handed out from data[] */
+    byte_t data[];
+} chunk_t;
+
+/* assembler library interface */
+#include "y64lib.h"
+
 #endif
 
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "y64asm.h"
+
+/*
+ * y64ld: link y64 relocatable object files (made by 'y64asm -c') into one
+ * y64 binary file. Images are laid out in command line order, each one
+ * aligned to OBJ_ALIGN, so the first object keeps its .pos addresses. An
+ * object takes up its image and its labels (e.g. a stack label after a
+ * .pos past the code), so the next one starts after both.
+ */
+
+#define err_print(_s, _a ...) fprintf(stderr, "[--]: "_s"\n", ## _a)
+
+#define OBJ_ALIGN 8
+
+/* a mapped object file */
+typedef struct object {
+    char *fname;
+    byte_t *data;   /* the whole mapped file */
+    size_t size;
+    obj_header_t hdr;
+    byte_t *syms;   /* first obj_symbol_t */
+    byte_t *rels;   /* first obj_reloc_t */
+    byte_t *image;
+    int64_t imgsize;
+    int64_t extent; /* end of the image or its last label, if that's later */
+    int64_t base;   /* address of the image in the linked binary */
+} object_t;
+
+object_t *objs = NULL;
+int nobj = 0;
+
+/* global symbol table: open addressing over the symbols of all objects */
+typedef struct gsym {
+    char *name;     /* points into the mapped object, not NUL-terminated */
+    int namelen;
+    int64_t addr;   /* linked address */
+    int ndef;       /* number of objects defining it */
+} gsym_t;
+
+gsym_t *gsymtab = NULL;
+unsigned long gsym_size = 0;
+
+static unsigned long hash_span(const char *s, int len)
+{
+    unsigned long h = 14695981039346656037UL;
+    while (len-- > 0) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/*
+ * gsym_slot: find the slot of the symbol in global symbol table
+ *
+ * return
+ *     the slot holding 'name', or the empty slot where it should be inserted
+ */
+static gsym_t *gsym_slot(char *name, int namelen)
+{
+    unsigned long mask = gsym_size - 1;
+    unsigned long i = hash_span(name, namelen) & mask;
+    while (gsymtab[i].name != NULL &&
+           (gsymtab[i].namelen != namelen || memcmp(gsymtab[i].name, name, namelen)))
+        i = (i + 1) & mask;
+    return &gsymtab[i];
+}
+
+/*
+ * load_object: map an object file and locate its tables and image
+ *
+ * return
+ *     0: success
+ *     -1: error, not a valid object file
+ */
+static int load_object(object_t *obj, char *fname)
+{
+    struct stat st;
+    byte_t *cur, *end;
+    uint32_t i;
+    int fd;
+
+    obj->fname = fname;
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        err_print("Can't open input file '%s'", fname);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(obj_header_t)) {
+        err_print("Invalid object file '%s'", fname);
+        close(fd);
+        return -1;
+    }
+    obj->size = st.st_size;
+    obj->data = mmap(NULL, obj->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (obj->data == MAP_FAILED) {
+        err_print("Can't map input file '%s'", fname);
+        return -1;
+    }
+
+    memcpy(&obj->hdr, obj->data, sizeof(obj_header_t));
+    if (obj->hdr.magic != OBJ_MAGIC) {
+        err_print("Invalid object file '%s'", fname);
+        return -1;
+    }
+
+    /* records are packed, so walk them to find where each table ends */
+    cur = obj->data + sizeof(obj_header_t);
+    end = obj->data + obj->size;
+    obj->syms = cur;
+    for (i = 0; i < obj->hdr.nsym; i++) {
+        obj_symbol_t osym;
+        if (cur + sizeof(osym) > end)
+            goto bad;
+        memcpy(&osym, cur, sizeof(osym));
+        cur += sizeof(osym) + osym.namelen;
+    }
+    obj->rels = cur;
+    for (i = 0; i < obj->hdr.nreloc; i++) {
+        obj_reloc_t orel;
+        if (cur + sizeof(orel) > end)
+            goto bad;
+        memcpy(&orel, cur, sizeof(orel));
+        cur += sizeof(orel) + orel.namelen;
+    }
+    if (cur > end)
+        goto bad;
+    obj->image = cur;
+    obj->imgsize = end - cur;
+    obj->extent = obj->hdr.extent > obj->imgsize ? obj->hdr.extent : obj->imgsize;
+    return 0;
+
+bad:
+    err_print("Truncated object file '%s'", fname);
+    return -1;
+}
+
+/*
+ * layout: assign image bases and enter every symbol into global symbol table
+ *
+ * return
+ *     size of the linked image, up to the end of the last image
+ */
+static int64_t layout(void)
+{
+    unsigned long total = 0;
+    int64_t base = 0, size = 0;
+    int i;
+    uint32_t j;
+
+    for (i = 0; i < nobj; i++)
+        total += objs[i].hdr.nsym;
+    gsym_size = 16;
+    while (gsym_size < total * 2)
+        gsym_size *= 2;
+    gsymtab = (gsym_t *)calloc(gsym_size, sizeof(gsym_t));
+
+    for (i = 0; i < nobj; i++) {
+        object_t *obj = &objs[i];
+        byte_t *cur = obj->syms;
+
+        base = (base + OBJ_ALIGN - 1) & ~(int64_t)(OBJ_ALIGN - 1);
+        obj->base = base;
+        base += obj->extent;
+        if (obj->imgsize > 0)
+            size = obj->base + obj->imgsize;
+
+        for (j = 0; j < obj->hdr.nsym; j++) {
+            obj_symbol_t osym;
+            memcpy(&osym, cur, sizeof(osym));
+            gsym_t *g = gsym_slot((char *)cur + sizeof(osym), osym.namelen);
+            if (g->name == NULL) {
+                g->name = (char *)cur + sizeof(osym);
+                g->namelen = osym.namelen;
+                g->addr = obj->base + osym.addr;
+            }
+            g->ndef++;
+            cur += sizeof(osym) + osym.namelen;
+        }
+    }
+    return size;
+}
+
+/*
+ * link_objects: copy every image into 'bin' and resolve its relocations
+ *
+ * return
+ *     0: success
+ *     -1: error, unknown or ambiguous symbol
+ */
+static int link_objects(byte_t *bin)
+{
+    int i;
+    uint32_t j;
+
+    for (i = 0; i < nobj; i++) {
+        object_t *obj = &objs[i];
+        byte_t *cur = obj->rels;
+
+        memcpy(bin + obj->base, obj->image, obj->imgsize);
+        for (j = 0; j < obj->hdr.nreloc; j++) {
+            obj_reloc_t orel;
+            char *name;
+            int64_t value = 0;
+
+            memcpy(&orel, cur, sizeof(orel));
+            name = (char *)cur + sizeof(orel);
+            cur += sizeof(orel) + orel.namelen;
+
+            if (orel.bytes > 8 || orel.offset < 0 ||
+                orel.offset + orel.bytes > obj->imgsize) {
+                err_print("Invalid relocation in '%s'", obj->fname);
+                return -1;
+            }
+
+            /* local fields hold image offsets, just move them to the base */
+            byte_t *field = bin + obj->base + orel.offset;
+            if (orel.type == R_LOCAL) {
+                memcpy(&value, field, orel.bytes);
+                value += obj->base;
+            } else {
+                gsym_t *g = gsym_slot(name, orel.namelen);
+                if (g->name == NULL) {
+                    err_print("Unknown symbol:'%.*s' in '%s'",
+                              (int)orel.namelen, name, obj->fname);
+                    return -1;
+                }
+                if (g->ndef > 1) {
+                    err_print("Ambiguous symbol:'%.*s' in '%s'",
+                              (int)orel.namelen, name, obj->fname);
+                    return -1;
+                }
+                value = g->addr;
+            }
+            memcpy(field, &value, orel.bytes);
+        }
+    }
+    return 0;
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [-o file.bin] file.o ...\n", pname);
+    printf("   -o name of the linked binary (default: first object with .bin)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    char outfname[512];
+    int nextarg = 1;
+    FILE *out = NULL;
+    int i;
+
+    outfname[0] = '\0';
+    if (nextarg < argc && !strcmp(argv[nextarg], "-o")) {
+        if (nextarg + 1 >= argc)
+            usage(argv[0]);
+        if (strlen(argv[nextarg+1]) > 500) {
+            err_print("File name too long");
+            exit(1);
+        }
+        strcpy(outfname, argv[nextarg+1]);
+        nextarg += 2;
+    }
+    if (nextarg >= argc)
+        usage(argv[0]);
+
+    if (outfname[0] == '\0') {
+        int rootlen = strlen(argv[nextarg]) - 2;
+        if (rootlen <= 0 || strcmp(argv[nextarg]+rootlen, ".o"))
+            usage(argv[0]);
+        if (rootlen > 500) {
+            err_print("File name too long");
+            exit(1);
+        }
+        memcpy(outfname, argv[nextarg], rootlen);
+        strcpy(outfname+rootlen, ".bin");
+    }
+
+    /* load objects */
+    nobj = argc - nextarg;
+    objs = (object_t *)calloc(nobj, sizeof(object_t));
+    for (i = 0; i < nobj; i++)
+        if (load_object(&objs[i], argv[nextarg+i]) < 0)
+            exit(1);
+
+    /* lay out images and resolve symbols */
+    int64_t binsize = layout();
+    byte_t *bin = (byte_t *)calloc(binsize ? binsize : 1, 1);
+    if (link_objects(bin) < 0) {
+        err_print("Link object files error");
+        exit(1);
+    }
+
+    /* generate .bin file */
+    out = fopen(outfname, "wb");
+    if (!out) {
+        err_print("Can't open output file '%s'", outfname);
+        exit(1);
+    }
+    fwrite(bin, binsize, 1, out);
+    fclose(out);
+
+    /* finit */
+    for (i = 0; i < nobj; i++)
+        munmap(objs[i].data, objs[i].size);
+    free(objs);
+    free(gsymtab);
+    free(bin);
+    return 0;
+}
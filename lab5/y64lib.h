@@ -0,0 +1,26 @@
+#ifndef _Y64_LIB_
+#define _Y64_LIB_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * assembler library: assemble y64 code from a memory buffer into a binary
+ * buffer, with no files (link y64asm.c built with -DY64ASM_LIB, which
+ * leaves out main). Each context holds all the state of one assembly, so
+ * assemblies may run concurrently in different threads.
+ *
+ * This header only needs standard types, so programs with their own y64
+ * definitions (e.g., y64sim.h) can include it too.
+ */
+typedef struct y64asm y64asm_t;
+
+#define Y64ASM_OPTIMIZE 0x1 /* peephole optimizer, like y64asm -O */
+
+y64asm_t *y64asm_new(void);
+void y64asm_free(y64asm_t *ctx);
+int y64asm_assemble(y64asm_t *ctx, const char *src, size_t len, int flags);
+unsigned char *y64asm_binary(y64asm_t *ctx, size_t *len);
+int64_t y64asm_symbol(y64asm_t *ctx, const char *name);
+
+#endif
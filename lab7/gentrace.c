@@ -0,0 +1,297 @@
+/*
+ * gentrace.c - Generate large synthetic allocation traces
+ *
+ * Unlike the gen_*.pl scripts in traces/, which write small adversarial
+ * patterns, gentrace models a long running program: request sizes come
+ * from a size-class histogram, every object lives for a random number
+ * of allocations, some objects grow through a sequence of reallocs, and
+ * the program may go through phases with different behavior. The trace
+ * is balanced and written as a .rep file or a binary trace (see trace.h).
+ *
+ * usage: gentrace [options] <file>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "trace.h"
+
+#define MAX_REQ   (256*1024)   /* largest request of any distribution */
+#define MAX_GROW  (1<<20)      /* reallocs don't grow an object past this */
+
+/* Size-class histograms */
+typedef enum {DIST_POWER, DIST_BIMODAL, DIST_WEB, NUM_DISTS} dist_t;
+static char *dist_names[] = {"power", "bimodal", "web"};
+
+/* A pending request for a live object: its next realloc, or its free */
+typedef struct {
+    long time;      /* allocation count when it happens */
+    int id;
+} event_t;
+
+/* Parameters (set by the command line) */
+static long num_allocs = 1000000;  /* number of objects allocated */
+static dist_t dist = DIST_POWER;   /* size distribution of the first phase */
+static double lifetime = 1000;     /* mean lifetime, in allocations */
+static int grow_pct = 5;           /* percent of objects grown by reallocs */
+static int num_phases = 1;         /* number of phases */
+static long max_live = 8<<20;      /* max live payload bytes */
+static int binary = 0;             /* write a binary trace */
+
+/* The trace being generated */
+static traceop_t *ops;
+static int num_ops;
+static int *sizes;      /* current size of each object */
+static int *steps;      /* reallocs left for each object */
+static long live;       /* live payload bytes */
+
+/* Min-heap of events, one for every live object */
+static event_t *heap;
+static int heap_n;
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+/* rnd - xorshift64*, a uniform double in (0, 1) */
+static double rnd(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0)
+        + 1e-18;
+}
+
+/* rnd_range - a uniform integer in [lo, hi] */
+static int rnd_range(int lo, int hi)
+{
+    return lo + (int)(rnd() * (hi - lo + 1));
+}
+
+/*
+ * rnd_size - draw a request size from a size-class histogram
+ *   power:   heavy tail, most requests are tiny (Pareto, alpha 1.3)
+ *   bimodal: small nodes and big buffers, 90/10
+ *   web:     headers and strings, page sized buffers, rare bodies
+ */
+static int rnd_size(dist_t d)
+{
+    double u = rnd();
+    int size;
+
+    switch (d) {
+        case DIST_POWER:
+            size = (int)(8.0 / pow(u, 1.0 / 1.3));
+            break;
+        case DIST_BIMODAL:
+            size = u < 0.9 ? rnd_range(8, 64) : rnd_range(4096, 32768);
+            break;
+        case DIST_WEB:
+        default:
+            if (u < 0.70)          /* small strings, often power-of-2 classes */
+                size = rnd() < 0.5 ? 16 << rnd_range(0, 4) : rnd_range(8, 256);
+            else if (u < 0.97)     /* I/O buffers, 1K multiples */
+                size = 1024 * rnd_range(1, 8);
+            else                   /* request/response bodies */
+                size = rnd_range(16384, MAX_REQ);
+            break;
+    }
+    if (size > MAX_REQ)
+        size = MAX_REQ;
+    return size;
+}
+
+/* rnd_life - draw a lifetime (exponential with the given mean) */
+static long rnd_life(double mean)
+{
+    return 1 + (long)(-log(rnd()) * mean);
+}
+
+static void heap_push(long time, int id)
+{
+    int i = heap_n++;
+    while (i > 0 && heap[(i-1)/2].time > time) {
+        heap[i] = heap[(i-1)/2];
+        i = (i-1)/2;
+    }
+    heap[i].time = time;
+    heap[i].id = id;
+}
+
+static event_t heap_pop(void)
+{
+    event_t top = heap[0], last = heap[--heap_n];
+    int i = 0, c;
+    while ((c = 2*i + 1) < heap_n) {
+        if (c + 1 < heap_n && heap[c+1].time < heap[c].time)
+            c++;
+        if (heap[c].time >= last.time)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static void emit(int type, int id, int size)
+{
+    ops[num_ops].type = type;
+    ops[num_ops].index = id;
+    ops[num_ops].size = size;
+    num_ops++;
+}
+
+/* do_event - run the due request of an object: grow it, or free it */
+static void do_event(event_t ev, double mean, int force_free)
+{
+    int id = ev.id;
+
+    if (steps[id] > 0 && !force_free) {
+        int newsize = sizes[id] + sizes[id] / 2 + 16;
+        if (newsize > MAX_GROW)
+            newsize = MAX_GROW;
+        live += newsize - sizes[id];
+        sizes[id] = newsize;
+        emit(REALLOC, id, newsize);
+        /* the next step comes soon, the free after a whole lifetime */
+        if (--steps[id] > 0)
+            heap_push(ev.time + rnd_range(1, 16), id);
+        else
+            heap_push(ev.time + rnd_life(mean), id);
+        return;
+    }
+    live -= sizes[id];
+    emit(FREE, id, 0);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gentrace [-b] [-n <allocs>] [-d power|bimodal|web] "
+            "[-l <lifetime>]\n"
+            "                [-g <grow%%>] [-p <phases>] [-m <max live>] "
+            "[-s <seed>] <file>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b            Write a binary trace (.btr) instead of .rep.\n");
+    fprintf(stderr, "\t-n <allocs>   Number of objects allocated (default 1000000).\n");
+    fprintf(stderr, "\t-d <dist>     Size distribution (default power).\n");
+    fprintf(stderr, "\t-l <lifetime> Mean lifetime of an object, in allocations "
+            "(default 1000).\n");
+    fprintf(stderr, "\t-g <grow%%>    Percent of objects grown by reallocs "
+            "(default 5).\n");
+    fprintf(stderr, "\t-p <phases>   Number of phases; each one moves to the next "
+            "distribution\n\t              and switches between short and long "
+            "lifetimes (default 1).\n");
+    fprintf(stderr, "\t-m <bytes>    Max live payload, oldest objects are freed "
+            "early (default 8M).\n");
+    fprintf(stderr, "\t-s <seed>     Random seed.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c, i, phase = -1;
+    long t;
+    double mean = lifetime;
+    dist_t pdist = dist;
+    FILE *out;
+
+    while ((c = getopt(argc, argv, "bn:d:l:g:p:m:s:h")) != EOF) {
+        switch (c) {
+            case 'b': binary = 1; break;
+            case 'n': num_allocs = atol(optarg); break;
+            case 'd':
+                for (i = 0; i < NUM_DISTS && strcmp(optarg, dist_names[i]); i++)
+                    ;
+                if (i == NUM_DISTS)
+                    usage();
+                dist = i;
+                break;
+            case 'l': lifetime = atof(optarg); break;
+            case 'g': grow_pct = atoi(optarg); break;
+            case 'p': num_phases = atoi(optarg); break;
+            case 'm': max_live = atol(optarg); break;
+            case 's': rng_state ^= strtoull(optarg, NULL, 0) * 0x9E3779B97F4A7C15ULL; break;
+            default: usage();
+        }
+    }
+    if (optind != argc - 1 || num_allocs <= 0 || num_allocs > (1L<<29) ||
+        lifetime < 1 || num_phases < 1 || max_live < MAX_GROW)
+        usage();
+
+    /* each object: one alloc, at most 8 reallocs, one free */
+    ops = (traceop_t *)malloc(num_allocs * 10 * sizeof(traceop_t));
+    sizes = (int *)calloc(num_allocs, sizeof(int));
+    steps = (int *)calloc(num_allocs, sizeof(int));
+    heap = (event_t *)malloc(num_allocs * sizeof(event_t));
+    if (!ops || !sizes || !steps || !heap) {
+        fprintf(stderr, "gentrace: out of memory\n");
+        exit(1);
+    }
+
+    for (t = 0; t < num_allocs; t++) {
+        int id = t;
+
+        /* phase change: next distribution, short and long lifetimes in turn */
+        if (t * num_phases / num_allocs != phase) {
+            phase = t * num_phases / num_allocs;
+            pdist = (dist + phase) % NUM_DISTS;
+            mean = (phase % 2) ? lifetime * 10 : lifetime;
+        }
+
+        /* requests that are due */
+        while (heap_n > 0 && heap[0].time <= t)
+            do_event(heap_pop(), mean, 0);
+
+        sizes[id] = rnd_size(pdist);
+
+        /* keep the live payload bounded by freeing the objects due first */
+        while (heap_n > 0 && live + sizes[id] > max_live)
+            do_event(heap_pop(), mean, 1);
+
+        live += sizes[id];
+        emit(ALLOC, id, sizes[id]);
+        if (rnd() * 100 < grow_pct) {
+            steps[id] = rnd_range(1, 8);
+            heap_push(t + rnd_range(1, 16), id);
+        }
+        else
+            heap_push(t + rnd_life(mean), id);
+    }
+
+    /* the trace is balanced: free whatever is still live */
+    while (heap_n > 0)
+        do_event(heap_pop(), mean, 1);
+
+    /* write it */
+    if ((out = fopen(argv[optind], binary ? "wb" : "w")) == NULL) {
+        fprintf(stderr, "gentrace: could not create %s\n", argv[optind]);
+        exit(1);
+    }
+    if (binary) {
+        trace_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = TRACE_MAGIC;
+        hdr.num_ids = num_allocs;
+        hdr.num_ops = num_ops;
+        hdr.weight = 1;
+        fwrite(&hdr, sizeof(hdr), 1, out);
+        fwrite(ops, sizeof(traceop_t), num_ops, out);
+    }
+    else {
+        fprintf(out, "%d\n%ld\n%d\n%d\n", 0, num_allocs, num_ops, 1);
+        for (i = 0; i < num_ops; i++) {
+            if (ops[i].type == FREE)
+                fprintf(out, "f %d\n", ops[i].index);
+            else
+                fprintf(out, "%c %d %d\n", ops[i].type == ALLOC ? 'a' : 'r',
+                        ops[i].index, ops[i].size);
+        }
+    }
+    if (fclose(out) != 0) {
+        fprintf(stderr, "gentrace: could not write %s\n", argv[optind]);
+        exit(1);
+    }
+    return 0;
+}
@@ -14,12 +14,22 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <limits.h>
 #include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
 #include "config.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -33,6 +43,16 @@
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
+/* Multithreaded benchmark (-T) */
+#define MT_RUNS        3    /* runs for each thread count, the best counts */
+#define MT_QUEUE_LEN 1024   /* frees in flight from a thread to the next (-x) */
+
+/* Latency histograms (-L): LAT_SUB buckets for every power of two, so a
+   bucket is at most 1/LAT_SUB wider than the latencies it holds */
+#define LAT_SUB_BITS   4
+#define LAT_SUB        (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS    ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
 /****************************** 
  * The key compound data types 
  *****************************/
@@ -44,13 +64,6 @@ typedef struct range_t {
     struct range_t *next;  /* next list element */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
@@ -60,6 +73,8 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mmapped binary trace file holding ops, or NULL */
+    size_t maplen;       /* length of that mapping */
 } trace_t;
 
 /* 
@@ -85,6 +100,42 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* What a parallel worker sends back to the driver for its trace */
+typedef struct {
+    stats_t stats;   /* stats of the trace */
+    int errors;      /* number of errs found in the trace */
+} result_t;
+
+/* Blocks that a thread of the multithreaded benchmark hands to the next
+   thread to free (-x): a ring that one thread pushes on and one pops from */
+typedef struct {
+    char *slot[MT_QUEUE_LEN];
+    unsigned long head;    /* next slot to pop, written by the consumer */
+    unsigned long tail;    /* next slot to push, written by the producer */
+    int done;              /* set when the producer won't push any more */
+} mt_queue_t;
+
+/* One thread of the multithreaded benchmark */
+typedef struct {
+    int id;                /* thread number, picks the first trace */
+    trace_t **traces;      /* the traces, shared by every thread */
+    int num_traces;
+    char **blocks;         /* this thread's pointers for the trace ids */
+    int libc;              /* run libc malloc instead of mm */
+    mt_queue_t *in;        /* blocks to free for the previous thread (-x) */
+    mt_queue_t *out;       /* blocks for the next thread to free (-x) */
+    pthread_barrier_t *start;
+    double ops;            /* requests replayed */
+    int failed;            /* a malloc or realloc returned NULL */
+} mt_thread_t;
+
+/* An HDR-style histogram of request latencies, in timer ticks */
+typedef struct {
+    unsigned long count[LAT_BUCKETS];
+    unsigned long n;       /* number of requests */
+    unsigned long max;     /* largest latency, exact */
+} lat_hist_t;
+
 /********************
  * Global variables
  *******************/
@@ -113,6 +164,7 @@ static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static trace_t *map_trace(char *path);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -124,6 +176,15 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_trace(char *filename, int tracenum, stats_t *stats);
+static void eval_mm_parallel(char **tracefiles, int n, stats_t *stats);
+
+/* Multithreaded throughput benchmark of mm and libc malloc */
+static void eval_mt(char **tracefiles, int n, char *counts, int cross, 
+        int run_libc);
+
+/* Latency of every request of mm and libc malloc, with tail percentiles */
+static void eval_latency(char **tracefiles, int n, int run_libc);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -142,13 +203,16 @@ int main(int argc, char **argv)
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
+    int parallel = 0;    /* If set, run each trace in its own worker (-p) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    char *mt_counts = NULL; /* Thread counts of the threaded benchmark (-T) */
+    int mt_cross = 0;    /* If set, frees go to another thread (-x) */
+    int latency = 0;     /* If set, only measure request latencies (-L) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -157,21 +221,22 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgalpT:xL")) != EOF) {
         switch (c) {
             case 'g': /* Generate summary info for the autograder */
                 autograder = 1;
                 break;
-            case 'f': /* Use one specific trace file only (relative to curr dir) */
-                num_tracefiles = 1;
-                if ((tracefiles = realloc(tracefiles, 2*sizeof(char *))) == NULL)
+            case 'f': /* Use specific trace files only (relative to curr dir) */
+                num_tracefiles++;
+                if ((tracefiles = realloc(tracefiles, 
+                                (num_tracefiles+1)*sizeof(char *))) == NULL)
                     unix_error("ERROR: realloc failed in main");
                 strcpy(tracedir, "./"); 
-                tracefiles[0] = strdup(optarg);
-                tracefiles[1] = NULL;
+                tracefiles[num_tracefiles-1] = strdup(optarg);
+                tracefiles[num_tracefiles] = NULL;
                 break;
             case 't': /* Directory where the traces are located */
-                if (num_tracefiles == 1) /* ignore if -f already encountered */
+                if (num_tracefiles > 0) /* ignore if -f already encountered */
                     break;
                 strcpy(tracedir, optarg);
                 if (tracedir[strlen(tracedir)-1] != '/') 
@@ -186,6 +251,18 @@ int main(int argc, char **argv)
             case 'V': /* Be more verbose than -v */
                 verbose = 2;
                 break;
+            case 'p': /* Evaluate the traces in parallel workers */
+                parallel = 1;
+                break;
+            case 'T': /* Multithreaded throughput with these thread counts */
+                mt_counts = optarg;
+                break;
+            case 'x': /* In the threaded benchmark, free on another thread */
+                mt_cross = 1;
+                break;
+            case 'L': /* Latency histograms of every request */
+                latency = 1;
+                break;
             case 'h': /* Print this message */
                 usage();
                 exit(0);
@@ -205,6 +282,18 @@ int main(int argc, char **argv)
         printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    /* The threaded benchmark only measures throughput */
+    if (mt_counts != NULL) {
+        eval_mt(tracefiles, num_tracefiles, mt_counts, mt_cross, run_libc);
+        exit(errors ? 1 : 0);
+    }
+
+    /* So does the latency report */
+    if (latency) {
+        eval_latency(tracefiles, num_tracefiles, run_libc);
+        exit(errors ? 1 : 0);
+    }
+
     /* Initialize the timing package */
     init_fsecs();
 
@@ -254,27 +343,17 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
-
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-        trace = read_trace(tracedir, tracefiles[i]);
-        mm_stats[i].ops = trace->num_ops;
-        if (verbose > 1)
-            printf("Checking mm_malloc for correctness, ");
-        mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-        if (mm_stats[i].valid) {
-            if (verbose > 1)
-                printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-            speed_params.trace = trace;
-            speed_params.ranges = ranges;
-            if (verbose > 1)
-                printf("and performance.\n");
-            mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-        }
-        free_trace(trace);
+    if (parallel) {
+        /* Each worker initializes its own simulated memory system */
+        eval_mm_parallel(tracefiles, num_tracefiles, mm_stats);
+    }
+    else {
+        /* Initialize the simulated memory system in memlib.c */
+        mem_init(); 
+
+        for (i=0; i < num_tracefiles; i++)
+            eval_mm_trace(tracefiles[i], i, &mm_stats[i]);
     }
 
     /* Display the mm results in a compact table */
@@ -365,9 +444,11 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-            (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or within a
+       region that the package mapped */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+            (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+            !mem_in_map(lo, hi)) {
         sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
                 lo, hi, mem_heap_lo(), mem_heap_hi());
         malloc_error(tracenum, opnum, msg);
@@ -454,13 +535,17 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
 
+    /* A binary trace file is mapped as is */
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if ((trace = map_trace(path)) != NULL)
+        return trace;
+
     /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+    if ((trace = (trace_t *) calloc(1, sizeof(trace_t))) == NULL)
         unix_error("malloc 1 failed in read_trance");
 
     /* Read the trace file header */
-    strcpy(path, tracedir);
-    strcat(path, filename);
     if ((tracefile = fopen(path, "r")) == NULL) {
         sprintf(msg, "Could not open %s in read_trace", path);
         unix_error(msg);
@@ -524,13 +609,75 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * map_trace - mmap a binary trace file (see trace.h), the requests are
+ *     used in place with no parsing. Returns NULL if the file is not a
+ *     binary trace file.
+ */
+static trace_t *map_trace(char *path)
+{
+    trace_t *trace;
+    trace_header_t hdr;
+    struct stat st;
+    char *map;
+    int fd, i;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        sprintf(msg, "Could not open %s in read_trace", path);
+        unix_error(msg);
+    }
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != TRACE_MAGIC) {
+        close(fd);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || hdr.num_ops < 0 || hdr.num_ids < 0 ||
+        st.st_size != sizeof(hdr) + (off_t)hdr.num_ops * sizeof(traceop_t)) {
+        sprintf(msg, "Truncated binary trace file %s", path);
+        app_error(msg);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        unix_error("mmap failed in map_trace");
+
+    if ((trace = (trace_t *) calloc(1, sizeof(trace_t))) == NULL)
+        unix_error("malloc 1 failed in map_trace");
+    trace->sugg_heapsize = hdr.sugg_heapsize;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = hdr.num_ops;
+    trace->weight = hdr.weight;
+    trace->ops = (traceop_t *)(map + sizeof(hdr));
+    trace->map = map;
+    trace->maplen = st.st_size;
+
+    /* The drivers index blocks[] with the ids, so check them once */
+    for (i = 0; i < trace->num_ops; i++)
+        if ((unsigned)trace->ops[i].index >= (unsigned)trace->num_ids) {
+            sprintf(msg, "Bad request id %d in binary trace file %s", 
+                    trace->ops[i].index, path);
+            app_error(msg);
+        }
+
+    if ((trace->blocks = 
+                (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+        unix_error("malloc 3 failed in map_trace");
+    if ((trace->block_sizes = 
+                (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+        unix_error("malloc 4 failed in map_trace");
+    return trace;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace() (or
+ *              unmap the requests of a binary trace file).
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map)           /* free the three arrays... */
+        munmap(trace->map, trace->maplen);
+    else
+        free(trace->ops);
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -623,7 +770,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
                 oldsize = trace->block_sizes[index];
                 if (size < oldsize) oldsize = size;
                 for (j = 0; j < oldsize; j++) {
-                    if (newp[j] != (index & 0xFF)) {
+                    if ((unsigned char)newp[j] != (index & 0xFF)) {
                         malloc_error(tracenum, i, "mm_realloc did not preserve the "
                                 "data from old block");
                         return 0;
@@ -658,11 +805,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   Utilization is the ratio hwm/peak, where peak is the most memory
+ *   that the heap and the regions of mem_map held at once while the
+ *   student's malloc package ran the trace (mem_peaksize).
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
@@ -744,7 +889,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peaksize());
 }
 
 
@@ -795,6 +940,594 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_mm_trace - Evaluate correctness, space utilization, and speed
+ *    of the mm malloc package on one trace file
+ */
+static void eval_mm_trace(char *filename, int tracenum, stats_t *stats)
+{
+    trace_t *trace;            /* stores the trace file in memory */
+    range_t *ranges = NULL;    /* keeps track of block extents for the trace */
+    speed_t speed_params;      /* input parameters to eval_mm_speed */ 
+
+    trace = read_trace(tracedir, filename);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+        printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, &ranges);
+    if (stats->valid) {
+        if (verbose > 1)
+            printf("efficiency, ");
+        stats->util = eval_mm_util(trace, tracenum, &ranges);
+        speed_params.trace = trace;
+        speed_params.ranges = ranges;
+        if (verbose > 1)
+            printf("and performance.\n");
+        stats->secs = fsecs(eval_mm_speed, &speed_params);
+    }
+    clear_ranges(&ranges);
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_parallel - Evaluate the mm malloc package on n traces, each
+ *    one in a forked worker with its own heap (mem_init), at most one
+ *    worker per CPU at a time. Every worker sends its result_t back 
+ *    through a pipe; a worker that dies makes its trace invalid.
+ */
+static void eval_mm_parallel(char **tracefiles, int n, stats_t *stats)
+{
+    long maxjobs = sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t *pids;
+    int *fds;
+    int next = 0, running = 0;
+    int i, status;
+    pid_t pid;
+    result_t result;
+
+    if (maxjobs < 1)
+        maxjobs = 1;
+    if ((pids = (pid_t *)calloc(n, sizeof(pid_t))) == NULL ||
+        (fds = (int *)calloc(n, sizeof(int))) == NULL)
+        unix_error("calloc in eval_mm_parallel failed");
+
+    fflush(stdout);
+    while (next < n || running > 0) {
+        /* start workers while there are free CPUs */
+        while (next < n && running < maxjobs) {
+            int pipefd[2];
+            if (pipe(pipefd) < 0)
+                unix_error("pipe in eval_mm_parallel failed");
+            if ((pid = fork()) < 0)
+                unix_error("fork in eval_mm_parallel failed");
+            if (pid == 0) {
+                close(pipefd[0]);
+                mem_init();
+                errors = 0;
+                memset(&result, 0, sizeof(result));
+                eval_mm_trace(tracefiles[next], next, &result.stats);
+                result.errors = errors;
+                fflush(stdout);
+                if (write(pipefd[1], &result, sizeof(result)) != sizeof(result))
+                    _exit(1);
+                _exit(0);
+            }
+            close(pipefd[1]);
+            pids[next] = pid;
+            fds[next] = pipefd[0];
+            next++;
+            running++;
+        }
+
+        /* collect a finished worker */
+        if ((pid = wait(&status)) < 0)
+            unix_error("wait in eval_mm_parallel failed");
+        for (i = 0; i < next && pids[i] != pid; i++)
+            ;
+        if (i == next)
+            continue;
+        running--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+            read(fds[i], &result, sizeof(result)) == sizeof(result)) {
+            stats[i] = result.stats;
+            errors += result.errors;
+        }
+        else {
+            /* the worker crashed (e.g., mm.c segfaulted) or exited */
+            memset(&stats[i], 0, sizeof(stats_t));
+            sprintf(msg, "worker for %s died", tracefiles[i]);
+            if (WIFSIGNALED(status))
+                sprintf(msg + strlen(msg), " (%s)", strsignal(WTERMSIG(status)));
+            errors++;
+            printf("ERROR [trace %d]: %s\n", i, msg);
+        }
+        close(fds[i]);
+    }
+    free(pids);
+    free(fds);
+}
+
+/*
+ * mt_free - free block p with the malloc package of thread t
+ */
+static void mt_free(mt_thread_t *t, char *p)
+{
+    if (t->libc)
+        free(p);
+    else
+        mm_free(p);
+}
+
+/*
+ * mt_drain - free the blocks that the previous thread handed to thread t
+ */
+static void mt_drain(mt_thread_t *t)
+{
+    mt_queue_t *q = t->in;
+    unsigned long head = q->head;
+    unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+        mt_free(t, q->slot[head % MT_QUEUE_LEN]);
+    __atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * mt_push - hand block p to the next thread to free. While the ring is
+ *     full, thread t frees what it was handed itself, so a cycle of
+ *     threads waiting on each other always makes progress.
+ */
+static void mt_push(mt_thread_t *t, char *p)
+{
+    mt_queue_t *q = t->out;
+    unsigned long tail = q->tail;
+
+    while (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == MT_QUEUE_LEN) {
+        mt_drain(t);
+        sched_yield();
+    }
+    q->slot[tail % MT_QUEUE_LEN] = p;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * mt_worker - a thread of the multithreaded benchmark: replay every trace,
+ *     starting with trace id mod n so that the threads don't run the same
+ *     trace at the same time. With -x, every free goes to the next thread.
+ */
+static void *mt_worker(void *ptr)
+{
+    mt_thread_t *t = (mt_thread_t *)ptr;
+    trace_t *trace;
+    char *p;
+    int i, k;
+
+    pthread_barrier_wait(t->start);
+    for (k = 0; k < t->num_traces && !t->failed; k++) {
+        trace = t->traces[(t->id + k) % t->num_traces];
+        for (i = 0; i < trace->num_ops; i++) {
+            int index = trace->ops[i].index;
+            int size = trace->ops[i].size;
+
+            switch (trace->ops[i].type) {
+                case ALLOC:
+                    p = t->libc ? malloc(size) : mm_malloc(size);
+                    break;
+                case REALLOC:
+                    p = t->libc ? realloc(t->blocks[index], size) :
+                        mm_realloc(t->blocks[index], size);
+                    break;
+                case FREE:
+                default:
+                    if (t->out != NULL)
+                        mt_push(t, t->blocks[index]);
+                    else
+                        mt_free(t, t->blocks[index]);
+                    continue;
+            }
+            if (p == NULL) {
+                t->failed = 1;
+                break;
+            }
+            t->blocks[index] = p;
+        }
+        t->ops += trace->num_ops;
+        if (t->in != NULL)
+            mt_drain(t);
+    }
+
+    /* Free what the previous thread hands over until it is done */
+    if (t->out != NULL)
+        __atomic_store_n(&t->out->done, 1, __ATOMIC_RELEASE);
+    if (t->in != NULL) {
+        while (!__atomic_load_n(&t->in->done, __ATOMIC_ACQUIRE)) {
+            mt_drain(t);
+            sched_yield();
+        }
+        mt_drain(t);
+    }
+    return NULL;
+}
+
+/*
+ * mt_run - run nthreads threads over the traces, MT_RUNS times, on a
+ *     fresh mm heap each time (or with libc malloc)
+ *
+ * return the best throughput in ops/sec, or 0 if a request failed
+ */
+static double mt_run(trace_t **traces, int n, int nthreads, int libc, int cross)
+{
+    mt_thread_t *threads;
+    mt_queue_t *queues = NULL;
+    pthread_t *tids;
+    pthread_barrier_t start;
+    struct timespec t0, t1;
+    double secs, ops, best = 0;
+    int i, r, max_ids = 0, failed = 0;
+
+    for (i = 0; i < n; i++)
+        if (traces[i]->num_ids > max_ids)
+            max_ids = traces[i]->num_ids;
+    threads = (mt_thread_t *)calloc(nthreads, sizeof(mt_thread_t));
+    tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    if (threads == NULL || tids == NULL)
+        unix_error("calloc in mt_run failed");
+    if (cross && (queues = (mt_queue_t *)calloc(nthreads, sizeof(mt_queue_t))) == NULL)
+        unix_error("calloc in mt_run failed");
+    for (i = 0; i < nthreads; i++)
+        if ((threads[i].blocks = (char **)calloc(max_ids, sizeof(char *))) == NULL)
+            unix_error("calloc in mt_run failed");
+
+    for (r = 0; r < MT_RUNS && !failed; r++) {
+        if (!libc) {
+            mem_reset_brk();
+            if (mm_init() < 0)
+                app_error("mm_init failed in mt_run");
+        }
+        pthread_barrier_init(&start, NULL, nthreads + 1);
+        for (i = 0; i < nthreads; i++) {
+            threads[i].id = i;
+            threads[i].traces = traces;
+            threads[i].num_traces = n;
+            threads[i].libc = libc;
+            threads[i].start = &start;
+            threads[i].ops = 0;
+            threads[i].failed = 0;
+            if (cross) {
+                memset(&queues[i], 0, sizeof(mt_queue_t));
+                threads[i].in = &queues[i];
+                threads[i].out = &queues[(i + 1) % nthreads];
+            }
+            if (pthread_create(&tids[i], NULL, mt_worker, &threads[i]) != 0)
+                unix_error("pthread_create in mt_run failed");
+        }
+        pthread_barrier_wait(&start);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < nthreads; i++)
+            pthread_join(tids[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        pthread_barrier_destroy(&start);
+
+        ops = 0;
+        for (i = 0; i < nthreads; i++) {
+            ops += threads[i].ops;
+            failed |= threads[i].failed;
+        }
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        if (ops / secs > best)
+            best = ops / secs;
+    }
+
+    for (i = 0; i < nthreads; i++)
+        free(threads[i].blocks);
+    free(threads);
+    free(tids);
+    free(queues);
+    return failed ? 0 : best;
+}
+
+/*
+ * eval_mt - Measure the throughput of the mm package (and libc malloc
+ *    with -l) with each thread count of the comma separated list counts,
+ *    and print how it scales from the first count.
+ */
+static void eval_mt(char **tracefiles, int n, char *counts, int cross, 
+        int run_libc)
+{
+    trace_t **traces;
+    double mm_base = 0, libc_base = 0, mm_tput, libc_tput;
+    char *s, *end;
+    long nthreads, max_threads = 0;
+    size_t heap_size;
+    int i;
+
+    for (s = counts; *s != '\0'; s = *end == ',' ? end + 1 : end) {
+        nthreads = strtol(s, &end, 10);
+        if (end == s || nthreads < 1 || (*end != ',' && *end != '\0'))
+            app_error("Bad thread count list for -T");
+        if (nthreads > max_threads)
+            max_threads = nthreads;
+    }
+
+    if ((traces = (trace_t **)calloc(n, sizeof(trace_t *))) == NULL)
+        unix_error("calloc in eval_mt failed");
+    for (i = 0; i < n; i++)
+        traces[i] = read_trace(tracedir, tracefiles[i]);
+
+    /* Every thread may need the heap of a whole run, and twice as much
+       when its frees are late. mm.c links blocks by 32-bit offsets in
+       the heap, so it can't be larger than that. */
+    heap_size = (size_t)MAX_HEAP * max_threads * (cross ? 2 : 1);
+    if (heap_size > UINT_MAX)
+        app_error("Too many threads for -T");
+    mem_init_size(heap_size);
+
+    printf("Every thread replays %d trace%s%s\n", n, n == 1 ? "" : "s",
+           cross ? ", and the next thread frees the blocks" : "");
+    printf("%7s%12s%8s", "threads", "mm Kops", "scale");
+    if (run_libc)
+        printf("%12s%8s", "libc Kops", "scale");
+    printf("\n");
+
+    for (s = counts; *s != '\0'; s = *end == ',' ? end + 1 : end) {
+        nthreads = strtol(s, &end, 10);
+        mm_tput = mt_run(traces, n, nthreads, 0, cross);
+        if (mm_tput == 0) {
+            sprintf(msg, "mm_malloc or mm_realloc failed with %ld threads", nthreads);
+            errors++;
+            printf("ERROR: %s\n", msg);
+            continue;
+        }
+        if (mm_base == 0)
+            mm_base = mm_tput;
+        printf("%7ld%12.0f%8.2f", nthreads, mm_tput / 1e3, mm_tput / mm_base);
+        if (run_libc) {
+            libc_tput = mt_run(traces, n, nthreads, 1, cross);
+            if (libc_base == 0)
+                libc_base = libc_tput;
+            printf("%12.0f%8.2f", libc_tput / 1e3, libc_tput / libc_base);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    for (i = 0; i < n; i++)
+        free_trace(traces[i]);
+    free(traces);
+}
+
+/*
+ * lat_now - read a low overhead timer: the cycle counter on x86,
+ *     otherwise the monotonic clock in ns
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define LAT_UNIT "cycles"
+static inline unsigned long lat_now(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+#else
+#define LAT_UNIT "ns"
+static inline unsigned long lat_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+#endif
+
+/*
+ * lat_overhead - the cost of reading the timer twice, the least of many
+ *     tries, which is subtracted from every latency
+ */
+static unsigned long lat_overhead(void)
+{
+    unsigned long t0, t1, best = ~0UL;
+    int i;
+
+    for (i = 0; i < 10000; i++) {
+        t0 = lat_now();
+        t1 = lat_now();
+        if (t1 - t0 < best)
+            best = t1 - t0;
+    }
+    return best;
+}
+
+/*
+ * lat_bucket - the histogram bucket of latency v: values below LAT_SUB
+ *     have their own bucket, larger ones share one of LAT_SUB buckets
+ *     for their power of two
+ */
+static int lat_bucket(unsigned long v)
+{
+    int e;
+
+    if (v < LAT_SUB)
+        return v;
+    e = 63 - __builtin_clzl(v);
+    return (e - LAT_SUB_BITS + 1) * LAT_SUB + (int)((v >> (e - LAT_SUB_BITS)) - LAT_SUB);
+}
+
+/*
+ * lat_bucket_max - the largest latency that falls in bucket b
+ */
+static unsigned long lat_bucket_max(int b)
+{
+    int shift;
+
+    if (b < LAT_SUB)
+        return b;
+    shift = b / LAT_SUB - 1;
+    return (((unsigned long)(LAT_SUB + b % LAT_SUB) + 1) << shift) - 1;
+}
+
+static void lat_add(lat_hist_t *h, unsigned long v)
+{
+    h->count[lat_bucket(v)]++;
+    h->n++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void lat_merge(lat_hist_t *dst, lat_hist_t *src)
+{
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+        dst->count[b] += src->count[b];
+    dst->n += src->n;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/*
+ * lat_percentile - the latency of the request of nearest rank for the
+ *     permille-th per mille, the ceiling of permille/1000 * n, rounded up
+ *     to the top of its bucket (but never past max)
+ */
+static unsigned long lat_percentile(lat_hist_t *h, int permille)
+{
+    unsigned long rank = (permille * h->n + 999) / 1000, seen = 0;
+    int b;
+
+    if (rank < 1)
+        rank = 1;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= rank)
+            break;
+    }
+    return lat_bucket_max(b) < h->max ? lat_bucket_max(b) : h->max;
+}
+
+/*
+ * lat_replay - replay a trace with mm (on a fresh heap) or libc malloc,
+ *     adding the latency of each request to hist[] by request type, or
+ *     without timing anything if hist is NULL
+ *
+ * return 0 if a malloc or realloc failed, 1 otherwise
+ */
+static int lat_replay(trace_t *trace, int libc, lat_hist_t *hist,
+        unsigned long ovhd)
+{
+    unsigned long t0, t1;
+    char *p;
+    int i;
+
+    if (!libc) {
+        mem_reset_brk();
+        if (mm_init() < 0)
+            app_error("mm_init failed in lat_replay");
+    }
+
+    for (i = 0; i < trace->num_ops; i++) {
+        int index = trace->ops[i].index;
+        int size = trace->ops[i].size;
+
+        t0 = lat_now();
+        switch (trace->ops[i].type) {
+            case ALLOC:
+                p = libc ? malloc(size) : mm_malloc(size);
+                break;
+            case REALLOC:
+                p = libc ? realloc(trace->blocks[index], size) :
+                    mm_realloc(trace->blocks[index], size);
+                break;
+            case FREE:
+            default:
+                if (libc)
+                    free(trace->blocks[index]);
+                else
+                    mm_free(trace->blocks[index]);
+                p = trace->blocks[index];
+                break;
+        }
+        t1 = lat_now();
+        if (p == NULL)
+            return 0;
+        trace->blocks[index] = p;
+        if (hist != NULL)
+            lat_add(&hist[trace->ops[i].type], t1 - t0 > ovhd ? t1 - t0 - ovhd : 0);
+    }
+    return 1;
+}
+
+/*
+ * lat_print - print the percentiles of every request type in hist[]
+ */
+static void lat_print(char *name, lat_hist_t *hist)
+{
+    static char *op_names[] = {"malloc", "free", "realloc"};
+    int t;
+
+    for (t = ALLOC; t <= REALLOC; t++) {
+        lat_hist_t *h = &hist[t];
+        if (h->n == 0)
+            continue;
+        printf("%-7s%-8s%10lu%9lu%9lu%9lu%11lu\n", t == ALLOC ? name : "",
+               op_names[t], h->n, lat_percentile(h, 500),
+               lat_percentile(h, 990), lat_percentile(h, 999), h->max);
+    }
+}
+
+/*
+ * eval_latency - Time every request of the mm package (and of libc
+ *    malloc with -l) on each trace, and print the p50, p99, p99.9 and
+ *    max latency of every request type, per trace and over all traces.
+ *    Each trace is checked first and replayed once untimed, so the
+ *    timed replay doesn't count first touches of the heap pages.
+ */
+static void eval_latency(char **tracefiles, int n, int run_libc)
+{
+    lat_hist_t *hist, total[3];
+    trace_t *trace;
+    range_t *ranges = NULL;
+    unsigned long ovhd = lat_overhead();
+    char name[16];
+    int i, libc, valid;
+
+    if ((hist = (lat_hist_t *)malloc(3 * sizeof(lat_hist_t))) == NULL)
+        unix_error("malloc in eval_latency failed");
+    mem_init();
+
+    printf("Latency of each request in %s, less %lu of timer overhead\n",
+           LAT_UNIT, ovhd);
+    printf("(percentiles are within 1/%d of the exact value)\n", LAT_SUB);
+    for (libc = run_libc; libc >= 0; libc--) {
+        printf("\nResults for %s malloc:\n", libc ? "libc" : "mm");
+        printf("%-7s%-8s%10s%9s%9s%9s%11s\n",
+               "trace", "request", "count", "p50", "p99", "p99.9", "max");
+        memset(total, 0, sizeof(total));
+        for (i = 0; i < n; i++) {
+            trace = read_trace(tracedir, tracefiles[i]);
+            valid = libc ? eval_libc_valid(trace, i) :
+                eval_mm_valid(trace, i, &ranges);
+            clear_ranges(&ranges);
+            memset(hist, 0, 3 * sizeof(lat_hist_t));
+            if (valid)
+                valid = lat_replay(trace, libc, NULL, ovhd) &&
+                    lat_replay(trace, libc, hist, ovhd);
+            if (valid) {
+                sprintf(name, "%d", i);
+                lat_print(name, hist);
+                lat_merge(&total[ALLOC], &hist[ALLOC]);
+                lat_merge(&total[FREE], &hist[FREE]);
+                lat_merge(&total[REALLOC], &hist[REALLOC]);
+            }
+            else {
+                if (!libc)
+                    errors++;
+                printf("%-7d%s\n", i, "not valid");
+            }
+            free_trace(trace);
+        }
+        lat_print("Total", total);
+    }
+    free(hist);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -974,14 +1707,21 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValpxL] [-f <file>]... [-t <dir>] [-T <n,...>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as a trace file (may be repeated),\n");
+    fprintf(stderr, "\t           either a .rep or a binary trace made by rep2btr.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Only measure the latency of every request and\n");
+    fprintf(stderr, "\t           print its percentiles for each trace.\n");
+    fprintf(stderr, "\t-p         Run each trace in its own parallel worker.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n,...> Only measure throughput with n threads, each\n");
+    fprintf(stderr, "\t           replaying every trace (e.g. -T 1,2,4,8).\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-x         With -T, free every block on the next thread.\n");
 }
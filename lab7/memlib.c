@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE     /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,28 +11,136 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * The regions mapped by mem_map, one per slot; a slot with size 0 is
+ * empty. A region keeps its slot while it is mapped, so mem_in_map can
+ * scan the slots without mem_lock. A full table is copied to one twice
+ * its size, and the old tables are only freed by mem_reset_brk.
+ */
+typedef struct {
+    char *addr;
+    size_t size;
+} map_slot_t;
+
+typedef struct map_table_t {
+    size_t len;                 /* Slots ever used */
+    size_t cap;
+    struct map_table_t *old;    /* The table this one replaced */
+    map_slot_t slot[];
+} map_table_t;
+
+#define MAP_SLOTS 64            /* Slots in the first table */
+
+/* Read and write a variable that other threads read without mem_lock */
+#define LOAD(v)         __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x)     __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static map_table_t *mem_maps; /* regions mapped by mem_map */
+static size_t mem_mapped;    /* bytes in those regions */
+static size_t mem_peak;      /* largest heap + mapped bytes since reset */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* serializes changes */
+
+/*
+ * update_peak - account for the current size of the heap and the
+ *    mapped regions in mem_peak. The caller holds mem_lock.
+ */
+static void update_peak(void)
+{
+    size_t size = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+
+    if (size > mem_peak)
+        STORE(mem_peak, size);
+}
+
+/*
+ * find_slot - return the slot of the region at addr, or NULL if there is
+ *    none. The caller holds mem_lock.
+ */
+static map_slot_t *find_slot(char *addr)
+{
+    size_t i;
+
+    for (i = 0; mem_maps != NULL && i < mem_maps->len; i++)
+        if (mem_maps->slot[i].size != 0 && mem_maps->slot[i].addr == addr)
+            return &mem_maps->slot[i];
+    return NULL;
+}
+
+/*
+ * new_slot - return an empty slot, in a larger table if all are in use,
+ *    or NULL if there is no memory for one. The caller holds mem_lock.
+ */
+static map_slot_t *new_slot(void)
+{
+    map_table_t *t = mem_maps;
+    size_t i, cap;
+
+    for (i = 0; t != NULL && i < t->len; i++)
+        if (t->slot[i].size == 0)
+            return &t->slot[i];
+    if (t == NULL || t->len == t->cap) {
+        cap = t == NULL ? MAP_SLOTS : 2 * t->cap;
+        if ((t = (map_table_t *)malloc(sizeof(map_table_t) + cap * sizeof(map_slot_t))) == NULL)
+            return NULL;
+        t->len = mem_maps == NULL ? 0 : mem_maps->len;
+        t->cap = cap;
+        t->old = mem_maps;
+        if (t->len > 0)
+            memcpy(t->slot, mem_maps->slot, t->len * sizeof(map_slot_t));
+        STORE(mem_maps, t);
+    }
+    t->slot[t->len].size = 0;
+    STORE(t->len, t->len + 1);
+    return &t->slot[t->len - 1];
+}
+
+
+/*
+ * release_pages - give the whole pages between lo and hi back to the
+ *    system; they read as zeros when they are touched again
+ */
+static void release_pages(char *lo, char *hi)
+{
+    size_t page = mem_pagesize();
+
+    lo = (char *)(((unsigned long)lo + page - 1) & ~(page - 1));
+    hi = (char *)((unsigned long)hi & ~(page - 1));
+    if (lo < hi)
+        madvise(lo, hi - lo, MADV_DONTNEED);
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
+{
+    mem_init_size(MAX_HEAP);
+}
+
+/*
+ * mem_init_size - initialize the memory system model with a heap of at
+ *    most size bytes instead of MAX_HEAP
+ */
+void mem_init_size(size_t size)
 {
     /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+    if ((mem_start_brk = (char *)malloc(size)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+    mem_max_addr = mem_start_brk + size;      /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_peak = 0;
 }
 
 /* 
@@ -43,31 +152,189 @@ void mem_deinit(void)
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and unmap the regions that are still mapped
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    map_table_t *t;
+    size_t i;
+
+    pthread_mutex_lock(&mem_lock);
+    for (i = 0; mem_maps != NULL && i < mem_maps->len; i++)
+        if (mem_maps->slot[i].size != 0)
+            munmap(mem_maps->slot[i].addr, mem_maps->slot[i].size);
+    while ((t = mem_maps) != NULL) {
+        mem_maps = t->old;
+        free(t);
+    }
+    mem_mapped = 0;
+    STORE(mem_brk, mem_start_brk);
+    mem_peak = 0;
+    pthread_mutex_unlock(&mem_lock);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area, or
+ *    shrinks it if incr is negative and returns the old brk. The pages
+ *    that a shrink cuts off go back to the system after mem_lock is
+ *    dropped, so the caller must not let the heap grow until it returns.
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    pthread_mutex_lock(&mem_lock);
+    old_brk = mem_brk;
+    if ((mem_brk + incr) > mem_max_addr) {
+	pthread_mutex_unlock(&mem_lock);
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
-    mem_brk += incr;
+    if ((mem_brk + incr) < mem_start_brk) {
+	pthread_mutex_unlock(&mem_lock);
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrank below the heap...\n");
+	return (void *)-1;
+    }
+    STORE(mem_brk, mem_brk + incr);
+    update_peak();
+    pthread_mutex_unlock(&mem_lock);
+    if (incr < 0)   /* The caller keeps the heap from growing meanwhile */
+        release_pages(old_brk + incr, old_brk);
     return (void *)old_brk;
 }
 
+/*
+ * mem_release - like madvise(MADV_DONTNEED): give the whole pages in the
+ *    size bytes at addr, a part of the heap that holds no data, back to
+ *    the system. Returns 0 on success, -1 if they aren't in the heap.
+ */
+int mem_release(void *addr, size_t size)
+{
+    char *lo = (char *)addr;
+
+    if (lo < mem_start_brk || lo + size > (char *)LOAD(mem_brk)) {
+        errno = EINVAL;
+        return -1;
+    }
+    release_pages(lo, lo + size);
+    return 0;
+}
+
+/*
+ * mem_map - map a region of size bytes outside the heap, like an
+ *    anonymous mmap. The region starts at a page boundary and is
+ *    zeroed. Returns (void *)-1 on failure.
+ */
+void *mem_map(size_t size)
+{
+    map_slot_t *m;
+    char *addr;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+        return (void *)-1;
+    }
+    pthread_mutex_lock(&mem_lock);
+    if ((m = new_slot()) == NULL) {
+        pthread_mutex_unlock(&mem_lock);
+        munmap(addr, size);
+        return (void *)-1;
+    }
+    STORE(m->addr, addr);
+    STORE(m->size, size);
+    STORE(mem_mapped, mem_mapped + size);
+    update_peak();
+    pthread_mutex_unlock(&mem_lock);
+    return (void *)addr;
+}
+
+/*
+ * mem_unmap - unmap the region at addr that mem_map or mem_remap
+ *    returned. Returns 0 on success, -1 if addr isn't such a region.
+ */
+int mem_unmap(void *addr)
+{
+    map_slot_t *m;
+    size_t size;
+
+    pthread_mutex_lock(&mem_lock);
+    if ((m = find_slot(addr)) == NULL) {
+        pthread_mutex_unlock(&mem_lock);
+        errno = EINVAL;
+        return -1;
+    }
+    size = m->size;
+    STORE(m->size, 0);
+    STORE(mem_mapped, mem_mapped - size);
+    pthread_mutex_unlock(&mem_lock);
+    munmap(addr, size);
+    return 0;
+}
+
+/*
+ * mem_remap - resize the region at addr to size bytes, like mremap: the
+ *    pages move to a new address if they can't grow in place, without
+ *    copying. Returns the new address, or (void *)-1 on failure, in which
+ *    case the region is unchanged.
+ */
+void *mem_remap(void *addr, size_t size)
+{
+    map_slot_t *m;
+    char *newaddr;
+    size_t old;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    pthread_mutex_lock(&mem_lock);
+    if ((m = find_slot(addr)) == NULL) {
+        pthread_mutex_unlock(&mem_lock);
+        errno = EINVAL;
+        return (void *)-1;
+    }
+    if (size == m->size) {
+        pthread_mutex_unlock(&mem_lock);
+        return addr;
+    }
+    old = m->size;
+    newaddr = mremap(addr, old, size, MREMAP_MAYMOVE);
+    if (newaddr == MAP_FAILED) {
+        pthread_mutex_unlock(&mem_lock);
+        fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+        return (void *)-1;
+    }
+    STORE(m->size, 0);      /* Empty while the slot changes */
+    STORE(m->addr, newaddr);
+    STORE(m->size, size);
+    STORE(mem_mapped, mem_mapped + size - old);
+    update_peak();
+    pthread_mutex_unlock(&mem_lock);
+    return (void *)newaddr;
+}
+
+/*
+ * mem_in_map - return true if the bytes lo to hi lie in one mapped region
+ */
+int mem_in_map(void *lo, void *hi)
+{
+    map_table_t *t = LOAD(mem_maps);
+    size_t i, n, size;
+    char *addr;
+
+    n = t == NULL ? 0 : LOAD(t->len);
+    for (i = 0; i < n; i++) {
+        size = LOAD(t->slot[i].size);
+        addr = LOAD(t->slot[i].addr);
+        if (size != 0 && (char *)lo >= addr && (char *)hi < addr + size)
+            return 1;
+    }
+    return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -81,7 +348,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(LOAD(mem_brk) - 1);
 }
 
 /*
@@ -89,7 +356,24 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return (size_t)(LOAD(mem_brk) - mem_start_brk);
+}
+
+/*
+ * mem_mapsize() - returns the number of bytes in mapped regions
+ */
+size_t mem_mapsize()
+{
+    return LOAD(mem_mapped);
+}
+
+/*
+ * mem_peaksize() - returns the largest number of bytes that the heap and
+ *    the mapped regions held together since the heap was last reset
+ */
+size_t mem_peaksize()
+{
+    return LOAD(mem_peak);
 }
 
 /*
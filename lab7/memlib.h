@@ -1,11 +1,19 @@
 #include <unistd.h>
 
 void mem_init(void);               
+void mem_init_size(size_t size);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+int mem_release(void *addr, size_t size);
+void *mem_map(size_t size);
+int mem_unmap(void *addr);
+void *mem_remap(void *addr, size_t size);
+int mem_in_map(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_peaksize(void);
 size_t mem_pagesize(void);
 
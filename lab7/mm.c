@@ -4,15 +4,36 @@
  * In this new approach, a block is allocated by scanning best fit free
  * blocks incrementing.　Free blocks is maintained by segregated free list.
  * If no suitable block is found, then increase the brk pointer. A block
- * is consisted of payload, padding, header and footer. Contiguous free
- * blocks are coalesced. Realloc is implemented based on logic of mm_malloc
- * and mm_free.
+ * is consisted of payload, padding and header; only free blocks have a
+ * footer, and a header bit tells whether the previous block is allocated.
+ * Free list links are 32-bit offsets in the heap. Contiguous free
+ * blocks are coalesced. Small blocks are placed at the front of a free
+ * block and large blocks at its end, so objects of different size classes
+ * don't interleave. Realloc grows a block in place whenever its neighbors
+ * or the top of the heap allow it, and a moved block gets headroom.
+ * Requests of up to 64 bytes don't get a block each: they are served
+ * from runs, page sized blocks cut into objects of one size class with
+ * a bitmap of the free ones, so tiny objects carry no header.
+ * Huge requests get a region of their own from mem_map instead, which
+ * is unmapped when they are freed and resized by mem_remap without a
+ * copy. Memory goes back to the system when a free block gets large: at
+ * the top of the heap it is cut off with a negative mem_sbrk, inside the
+ * heap its pages are released with mem_release.
+ *
+ * The package is thread safe. Threads are assigned to arenas in turn; an
+ * arena is a heap of its own with a lock, and its blocks lie in segments
+ * of the shared brk heap. Each thread caches a few free objects of every
+ * size class, so most small requests take no lock. A block freed by a
+ * thread of another arena goes back to its arena right away if the lock
+ * is free, and otherwise onto a lock-free queue that the arena empties
+ * the next time it is locked.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -26,11 +47,76 @@
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
-/* Amount of free lists */
-#define LIST_NUM 16
-
-/* Space overhead in every block */
-#define OVERHEAD 8
+/* Amount of free lists: four per power of two from 2^MIN_SHIFT bytes on */
+#define LIST_NUM  48
+#define MIN_SHIFT 4
+
+/* Free blocks of at least this size (64 KiB) are kept in a tree instead
+   of lists: few blocks are that large, so the lists take the churn */
+#define TREE_MIN  (1 << (MIN_SHIFT + LIST_NUM/4))
+
+/* Space overhead in every allocated block: the header */
+#define OVERHEAD 4
+
+/* Smallest block: header, the two free list links and footer */
+#define MIN_BLOCK 16
+
+/* find_fit picks the best of this many fits */
+#define FIT_CANDIDATES 8
+
+/* Blocks of at least this size are placed at the end of a free block */
+#define SPLIT_BACK 96
+
+/* A realloc block that moves again gets 1/REALLOC_HEADROOM of its size as
+   headroom: one that has to move twice is likely to keep growing */
+#define REALLOC_HEADROOM 4
+
+/* Requests of up to SLAB_MAX bytes are objects in runs of RUN_SIZE bytes,
+   one run per size class of DSIZE bytes */
+#define SLAB_MAX     64
+#define SLAB_CLASSES (SLAB_MAX / 8)
+#define RUN_SIZE     4096
+
+/* A run is started only once this many small blocks are live: a run for
+   a few small objects would waste most of its page */
+#define SLAB_START   32
+
+/* Thread caches hold up to TCACHE_MAX free objects per size class, and
+   take up to TCACHE_FILL objects at a time from the runs of the arena */
+#define TCACHE_MAX   16
+#define TCACHE_FILL  8
+
+/* Requests of at least MMAP_THRESHOLD bytes get a mapped region of their
+   own (a block that grows past it moves to one when it can't grow in
+   place), so freeing them gives the memory back. Build with
+   -DMMAP_THRESHOLD=<bytes> to change it. */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (64*1024)
+#endif
+
+/* A free block at the top of the heap of more than TRIM_THRESHOLD bytes
+   is cut down to about TRIM_PAD bytes, but only once the arena has freed
+   TRIM_IDLE blocks without growing the heap: a program that frees a lot
+   and soon allocates it again would otherwise trim and extend the heap
+   over and over, faulting in its pages each time. */
+#define TRIM_THRESHOLD (256*1024)
+#define TRIM_PAD       (64*1024)
+#define TRIM_IDLE      4096
+
+/* The pages of free blocks of at least RELEASE_MIN bytes are released
+   all at once, every time RELEASE_DIRTY bytes have been freed into such
+   blocks, so a burst of frees makes a few system calls rather than one
+   each */
+#define RELEASE_MIN    (256*1024)
+#define RELEASE_DIRTY  (4096*1024)
+
+/* Number of arenas */
+#define ARENA_NUM    8
+
+/* The header of an allocated block has the arena in its top bits, so a
+   block is smaller than 1 << ARENA_SHIFT bytes */
+#define ARENA_SHIFT  29
+#define SIZE_MASK    ((1u << ARENA_SHIFT) - DSIZE)
 
 /* Basic constants and macros */
 #define WSIZE       4       /* Word and header/footer size (bytes) */
@@ -42,85 +128,330 @@
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)   ((size) | (alloc))
 
+/* Header bit set if the previous block is allocated (it has no footer) */
+#define PREV_ALLOC  0x2
+
+/* Header bit set in a block that has a mapped region of its own */
+#define MAPPED      0x4
+
+/* Header bit set in a free block whose pages are released; set_block
+   clears it, as a block that changes may have dirty pages again */
+#define RELEASED    0x4
+
 /* Read and write a word at address p */
 #define GET(p)      (*(unsigned int *)(p))
 #define PUT(p, val) (*(unsigned int *)(p) = (val))
 
-/* Read and write a address at address p */
-#define GETADDR(p)      (*(unsigned long *)(p))
-#define PUTADDR(p, val) (*(unsigned long *)(p) = (val))
+/* Read and write a link to a free block at address p: a 32-bit offset
+   from the start of the heap, 0 for NULL */
+#define GETLINK(p)      (GET(p) ? heap_base + GET(p) : NULL)
+#define PUTLINK(p, bp)  PUT(p, (bp) ? (unsigned int)((char *)(bp) - heap_base) : 0)
 
-/* Read the size and allocated fields from address p */
-#define GET_SIZE(p)     (GET(p) & ~0x7)
-#define GET_ALLOC(p)    (GET(p) & 0x1)
+/* Read the size, allocated and prev-allocated fields from address p */
+#define GET_SIZE(p)         (GET(p) & SIZE_MASK)
+#define GET_ALLOC(p)        (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p)   (GET(p) & PREV_ALLOC)
 
-/* Given block ptr bp, compute address of its header and footer */
+/* Read and write a header that another thread may read at the same
+   time: any thread reads the arena of an allocated block, while its arena
+   sets the prev-allocated bit */
+#define GET_SHARED(p)       __atomic_load_n((unsigned int *)(p), __ATOMIC_RELAXED)
+#define PUT_SHARED(p, val)  __atomic_store_n((unsigned int *)(p), (val), __ATOMIC_RELAXED)
+
+/* Read the arena of an allocated block from address p */
+#define GET_ARENA(p)        (GET_SHARED(p) >> ARENA_SHIFT)
+
+/* Given block ptr bp, compute address of its header and footer (free only) */
 #define HDRP(bp)    ((char *)(bp) - WSIZE)
 #define FTRP(bp)    ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks */
+/* Given block ptr bp, compute address of next and previous blocks (the
+   previous block must be free, as only free blocks have a footer) */
 #define NEXT_BLKP(bp)   ((char *)(bp) + GET_SIZE((char *)(bp) - WSIZE))
 #define PREV_BLKP(bp)   ((char *)(bp) - GET_SIZE((char *)(bp) - DSIZE))
 
-/* Get successor and predecessor pointer in the free block */
+/* Get successor and predecessor link in the free block */
 #define PRED(bp)    ((char *)(bp))
-#define SUCC(bp)    ((char *)(bp) + DSIZE)
+#define SUCC(bp)    ((char *)(bp) + WSIZE)
 
 /* Get previous and next free block ptr */
-#define NEXT_FBLKP(bp)  ((char *)GETADDR(SUCC(bp)))
-#define PREV_FBLKP(bp)  ((char *)GETADDR(PRED(bp)))
-
+#define NEXT_FBLKP(bp)  GETLINK(SUCC(bp))
+#define PREV_FBLKP(bp)  GETLINK(PRED(bp))
+
+/* Get and set the children of a large free block in the tree */
+#define LEFT(bp)            GETLINK(PRED(bp))
+#define RIGHT(bp)           GETLINK(SUCC(bp))
+#define SET_LEFT(bp, p)     PUTLINK(PRED(bp), p)
+#define SET_RIGHT(bp, p)    PUTLINK(SUCC(bp), p)
+
+/* Given run ptr r (an allocated block), compute address of its object
+   size, number of free objects, links in the list of its class, bitmap
+   of free objects and first object */
+#define RUN_OSIZE(r)    ((char *)(r))
+#define RUN_NFREE(r)    ((char *)(r) + WSIZE)
+#define RUN_PREV(r)     ((char *)(r) + 2*WSIZE)
+#define RUN_NEXT(r)     ((char *)(r) + 3*WSIZE)
+#define RUN_MAP(r)      ((unsigned long *)((char *)(r) + 4*WSIZE))
+#define RUN_MAP_WORDS   8
+#define RUN_HDR         (4*WSIZE + RUN_MAP_WORDS*sizeof(unsigned long))
+#define RUN_OBJS(r)     ((char *)(r) + RUN_HDR)
+
+/* Number of objects of osize bytes in a run, and the class of a request */
+#define RUN_NOBJS(osize)    ((int)((RUN_SIZE - OVERHEAD - RUN_HDR) / (osize)))
+#define SLAB_CLASS(size)    (((size) - 1) / DSIZE)
+
+/* Given mapped block ptr bp, compute address of its region, which starts
+   with the size of the region; the header of bp ends the first MAP_HDR
+   bytes */
+#define MAP_HDR         (2*DSIZE)
+#define MAP_REGION(bp)  ((char *)(bp) - MAP_HDR)
+#define MAP_SIZE(r)     (*(size_t *)(r))
+
+/* Link of a free object in a thread cache or a remote queue */
+#define NEXT_OBJ(p)     (*(void **)(p))
 
+/*
+ * An arena: the free lists, tree and runs of the blocks of some threads.
+ * Its blocks lie in segments, parts of the heap that each start with a
+ * prologue and end with an epilogue; the arena grows its last segment if
+ * it is at the top of the heap, and starts a new one otherwise. The lock
+ * guards everything but the queue of blocks freed by other threads.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned int id;                  /* Index in arenas, kept in headers */
+    char *top;                        /* Epilogue of the last segment */
+    char *free_listp[LIST_NUM];       /* Point to the list of free blocks */
+    unsigned long list_map;           /* Bit i is set if free_listp[i] isn't empty */
+    char *tree_root;                  /* Root of the tree of large free blocks */
+    char *slab_runs[SLAB_CLASSES];    /* Runs with free objects, per class */
+    size_t small_live;                /* Live blocks of at most SLAB_MAX bytes */
+    size_t dirty;                     /* Bytes freed into large blocks since
+                                         their pages were released */
+    size_t idle;                      /* Blocks freed since the heap grew */
+    char *moved;                      /* Block the last realloc moved to */
+    void *remote;                     /* Blocks freed by other threads */
+} arena_t;
+
+/* Where a run starts in every RUN_SIZE page of the heap, see run_of */
+typedef struct {
+    size_t len;
+    unsigned short page[];
+} run_map_t;
+
+/* A thread cache: free objects of runs, linked by NEXT_OBJ */
+typedef struct {
+    unsigned int gen;                 /* heap_gen it belongs to */
+    void *list[SLAB_CLASSES];
+    int count[SLAB_CLASSES];
+} tcache_t;
+
+static char* heap_base = NULL;      /* mem_heap_lo(), the base of links */
 static char* heap_listp = NULL;     /* Point to the start of heap */
-static char* free_listp[LIST_NUM];    /* Point to the list of free blocks */
+static arena_t arenas[ARENA_NUM];
+static unsigned int next_arena;     /* Arena of the next new thread */
+static unsigned int heap_gen;       /* Number of mm_init calls */
+static run_map_t *run_map;
+static pthread_mutex_t brk_lock = PTHREAD_MUTEX_INITIALIZER;  /* Guards mem_sbrk */
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;  /* Guards run_map changes */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;    /* Flushes the cache of an exiting thread */
+
+static __thread arena_t *arena;         /* Arena locked by this thread */
+static __thread arena_t *thread_arena;  /* Arena this thread is assigned to */
+static __thread tcache_t tcache;
 
 static void *extend_heap(size_t words);
+static void *grow_heap(size_t asize);
 static void *find_fit(size_t asize);
-static void *find_first_fit(size_t asize);
-static void *find_last_fit(size_t asize);
-static void place(void *bp, size_t asize);
+static void *place(void *bp, size_t asize);
 static void *coalesce(void *bp);
+static void *block_alloc(size_t asize);
+static void block_free(void *bp);
+static void release_block(void *bp);
+static void free_owned(void *ptr, char *run);
+static arena_t *get_arena(void);
+static void arena_lock(arena_t *a);
+static void arena_unlock(void);
+static int arena_try(arena_t *a);
+static void remote_push(arena_t *a, void *ptr);
+static void *arena_malloc(size_t size);
+static void *block_realloc(void *ptr, size_t size);
+static void *huge_alloc(size_t size);
+static void *huge_realloc(void *ptr, size_t size);
 int mm_check();
 
 
 /*
- * get_block_index - get index of free block where it should be inserted
+ * get_block_index - get index of free block where it should be inserted.
+ *     Lists are quarter-power-of-two classes: the exponent of the size
+ *     picks four lists and the two bits below the leading one pick one.
+ *     Larger blocks go to the tree.
  */
-int get_block_index(int size)
+int get_block_index(size_t size)
 {
-    if (size <= 40) {
-        return 0;
-    } else if (size > 40 && size <= 128) {
-        return 1;
-    } else if (size > 128 && size <= 256) {
-        return 2;
-    } else if (size > 256 && size <= 512) {
-        return 3;
-    } else if (size > 512 && size <= 1024) {
-        return 4;
-    } else if (size > 1024 && size <= 2048) {
-        return 5;
-    } else if (size > 2048 && size <= 4096) {
-        return 6;
-    } else if (size > 4096 && size <= 8192) {
-        return 7;
-    } else if (size > 8192 && size <= 16384) {
-        return 8;
-    } else if (size > 16384 && size <= 32768) {
-        return 9;
-    } else if (size > 32768 && size <= 65536) {
-        return 10;
-    } else if (size > 65536 && size <= 131072) {
-        return 11;
-    } else if (size > 131072 && size <= 262144) {
-        return 12;
-    } else if (size > 262144 && size <= 524288) {
-        return 13;
-    } else if (size > 524288 && size <= 1048576) {
-        return 14;
+    int e = 63 - __builtin_clzl(size);
+    int index = ((e - MIN_SHIFT) << 2) | ((size >> (e - 2)) & 3);
+
+    return index < LIST_NUM ? index : LIST_NUM - 1;
+}
+
+/*
+ * tree_cmp - compare the key (size, addr) with free block bp: blocks are
+ *     ordered by size, and blocks of the same size by address
+ */
+static int tree_cmp(size_t size, char *addr, char *bp)
+{
+    size_t bsize = GET_SIZE(HDRP(bp));
+
+    if (size != bsize)
+        return size < bsize ? -1 : 1;
+    return addr < bp ? -1 : addr > bp;
+}
+
+/*
+ * tree_splay - top-down splay of the tree t on the key (size, addr): the
+ *     block with that key, or the last block on its search path, becomes
+ *     the root. Large free blocks are kept in this splay tree, with the
+ *     two children in the place of the list pointers. Only a search
+ *     splays the whole path, so the blocks that requests look for stay
+ *     near the root, while frees just add and drop nodes.
+ *
+ * return the new root
+ */
+static char *tree_splay(char *t, size_t size, char *addr)
+{
+    unsigned int n[2] = {0, 0};     /* holds the two halves as LEFT/RIGHT */
+    char *l = (char *)n, *r = (char *)n, *y;
+    int c;
+
+    if (t == NULL)
+        return NULL;
+    for (;;) {
+        c = tree_cmp(size, addr, t);
+        if (c < 0) {
+            if (LEFT(t) == NULL)
+                break;
+            if (tree_cmp(size, addr, LEFT(t)) < 0) {    /* rotate right */
+                y = LEFT(t);
+                SET_LEFT(t, RIGHT(y));
+                SET_RIGHT(y, t);
+                t = y;
+                if (LEFT(t) == NULL)
+                    break;
+            }
+            SET_LEFT(r, t);                             /* link right */
+            r = t;
+            t = LEFT(t);
+        } else if (c > 0) {
+            if (RIGHT(t) == NULL)
+                break;
+            if (tree_cmp(size, addr, RIGHT(t)) > 0) {   /* rotate left */
+                y = RIGHT(t);
+                SET_RIGHT(t, LEFT(y));
+                SET_LEFT(y, t);
+                t = y;
+                if (RIGHT(t) == NULL)
+                    break;
+            }
+            SET_RIGHT(l, t);                            /* link left */
+            l = t;
+            t = RIGHT(t);
+        } else {
+            break;
+        }
+    }
+    /* assemble */
+    SET_RIGHT(l, LEFT(t));
+    SET_LEFT(r, RIGHT(t));
+    SET_LEFT(t, RIGHT((char *)n));
+    SET_RIGHT(t, LEFT((char *)n));
+    return t;
+}
+
+/*
+ * tree_insert - insert a large free block into the tree as a leaf; only
+ *     tree_fit splays, so a free doesn't reshape the tree
+ */
+static void tree_insert(char *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    char *t = arena->tree_root;
+
+    SET_LEFT(bp, NULL);
+    SET_RIGHT(bp, NULL);
+    if (t == NULL) {
+        arena->tree_root = bp;
+        return;
+    }
+    for (;;) {
+        if (tree_cmp(size, bp, t) < 0) {
+            if (LEFT(t) == NULL) {
+                SET_LEFT(t, bp);
+                return;
+            }
+            t = LEFT(t);
+        } else {
+            if (RIGHT(t) == NULL) {
+                SET_RIGHT(t, bp);
+                return;
+            }
+            t = RIGHT(t);
+        }
+    }
+}
+
+/*
+ * tree_remove - remove a large free block from the tree: its place goes
+ *     to the join of its two subtrees
+ */
+static void tree_remove(char *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    char *parent = NULL, *t = arena->tree_root, *sub;
+
+    while (t != bp) {
+        parent = t;
+        t = tree_cmp(size, bp, t) < 0 ? LEFT(t) : RIGHT(t);
+    }
+    if (LEFT(bp) == NULL) {
+        sub = RIGHT(bp);
     } else {
-        return 15;
+        /* the largest block on the left has no right child once splayed */
+        sub = tree_splay(LEFT(bp), size, bp);
+        SET_RIGHT(sub, RIGHT(bp));
     }
+    if (parent == NULL)
+        arena->tree_root = sub;
+    else if (LEFT(parent) == bp)
+        SET_LEFT(parent, sub);
+    else
+        SET_RIGHT(parent, sub);
+    SET_LEFT(bp, NULL);
+    SET_RIGHT(bp, NULL);
+}
+
+/*
+ * tree_fit - find the best fit for asize in the tree: the smallest large
+ *     free block of at least asize bytes, the one with the lowest address
+ *     among blocks of that size
+ */
+static char *tree_fit(size_t asize)
+{
+    char *bp;
+
+    if (arena->tree_root == NULL)
+        return NULL;
+
+    /* (asize, NULL) is below every block of asize bytes */
+    arena->tree_root = tree_splay(arena->tree_root, asize, NULL);
+    if (GET_SIZE(HDRP(arena->tree_root)) >= asize)
+        return arena->tree_root;
+
+    /* the root is the predecessor of the key: take its successor */
+    for (bp = RIGHT(arena->tree_root); bp != NULL && LEFT(bp) != NULL; bp = LEFT(bp))
+        ;
+    return bp;
 }
 
 /*
@@ -133,17 +464,19 @@ void insert_block(char *bp)
 
     /* find corresponding free list */
     int csize = GET_SIZE(HDRP(bp));
-    int index = get_block_index(csize);
-    char *listp = free_listp[index];
-
-    if (listp == NULL) {
-        PUTADDR(SUCC(bp), 0);
-    } else {
-        PUTADDR(SUCC(bp), (unsigned long)listp);
-        PUTADDR(PRED(listp), (unsigned long)bp);
+    if (csize >= TREE_MIN) {
+        tree_insert(bp);
+        return;
     }
-    PUTADDR(PRED(bp), 0);
-    free_listp[index] = bp;
+    int index = get_block_index(csize);
+    char *listp = arena->free_listp[index];
+
+    PUTLINK(SUCC(bp), listp);
+    if (listp != NULL)
+        PUTLINK(PRED(listp), bp);
+    PUTLINK(PRED(bp), NULL);
+    arena->free_listp[index] = bp;
+    arena->list_map |= 1UL << index;
 }
 
 /*
@@ -156,53 +489,78 @@ void remove_block(char *bp)
 
     /* find corresponding free list */
     int csize = GET_SIZE(HDRP(bp));
+    if (csize >= TREE_MIN) {
+        tree_remove(bp);
+        return;
+    }
     int index = get_block_index(csize);
 
     char *prev = PREV_FBLKP(bp);
     char *next = NEXT_FBLKP(bp);
     if (!prev && !next) {
-        free_listp[index] = NULL;
+        arena->free_listp[index] = NULL;
+        arena->list_map &= ~(1UL << index);
     } else if (!prev && next) {
-        PUTADDR(PRED(next), 0);
-        free_listp[index] = next;
+        PUTLINK(PRED(next), NULL);
+        arena->free_listp[index] = next;
     } else if (prev && !next) {
-        PUTADDR(SUCC(prev), 0);
+        PUTLINK(SUCC(prev), NULL);
     } else {
-        PUTADDR(SUCC(prev), GETADDR(SUCC(bp)));
-        PUTADDR(PRED(next), GETADDR(PRED(bp)));
+        PUTLINK(SUCC(prev), next);
+        PUTLINK(PRED(next), prev);
     }
-    PUTADDR(PRED(bp), 0);
-    PUTADDR(SUCC(bp), 0);
+    PUTLINK(PRED(bp), NULL);
+    PUTLINK(SUCC(bp), NULL);
 }
 
+/*
+ * set_block - write the header of block bp (and the footer if it is free),
+ *     keeping its prev-allocated bit, and update the prev-allocated bit of
+ *     the next block
+ */
+static void set_block(void *bp, size_t size, int alloc)
+{
+    PUT(HDRP(bp), PACK(size, alloc) | GET_PREV_ALLOC(HDRP(bp)) |
+                  (alloc ? arena->id << ARENA_SHIFT : 0));
+    if (alloc) {
+        PUT_SHARED(HDRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))) | PREV_ALLOC);
+    } else {
+        PUT(FTRP(bp), PACK(size, 0));
+        PUT_SHARED(HDRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))) & ~PREV_ALLOC);
+    }
+}
 
 /*
  * mm_init - initialize the malloc package.
  */
 int mm_init(void)
 {
+    void *bp;
 
-    /* Create the initial empty heap */
-    if ((heap_listp = mem_sbrk(4*WSIZE)) == (void *)-1)
-        return -1;
-    PUT(heap_listp, 0);                             /* Alignment padding */
-    PUT(heap_listp + (1*WSIZE), PACK(DSIZE, 1));    /* Prologue header */
-    PUT(heap_listp + (2*WSIZE), PACK(DSIZE, 1));    /* Prologue footer */
-    PUT(heap_listp + (3*WSIZE), PACK(0, 1));        /* Epilogue header */
-    heap_listp += (2*WSIZE);
+    heap_base = mem_heap_lo();
+    heap_listp = heap_base + 2*WSIZE;   /* Prologue of the first segment */
+    run_map = NULL;
+    heap_gen++;                         /* Drops the thread caches */
 
-    for (int i=0 ; i<LIST_NUM ; i++) {
-        free_listp[i] = NULL;
+    for (int i=0 ; i<ARENA_NUM ; i++) {
+        memset(&arenas[i], 0, sizeof(arena_t));
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        arenas[i].id = i;
     }
 
-    /* extend heap */
-    if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
-        return -1;
-    return 0;
+    /* Create the initial heap, the first segment of the caller's arena */
+    arena_lock(get_arena());
+    pthread_mutex_lock(&brk_lock);
+    bp = extend_heap(CHUNKSIZE/WSIZE);
+    pthread_mutex_unlock(&brk_lock);
+    arena_unlock();
+    return bp == NULL ? -1 : 0;
 }
 
 /*
- * extend_heap - extends the heap with a new free block.
+ * extend_heap - extends the heap with a new free block. The block grows
+ *     the last segment of the arena if it is at the top of the heap, and
+ *     starts a new segment otherwise. The caller holds brk_lock.
  */
 static void *extend_heap(size_t words)
 {
@@ -211,246 +569,749 @@ static void *extend_heap(size_t words)
 
     /* Allocate an even number of words to maintain alignment */
     size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
-    if ((long)(bp = mem_sbrk(size)) == -1)
-        return NULL;
+    if (arena->top == (char *)mem_heap_hi() + 1) {
+        /* The old epilogue header, now the block header, has the
+           prev-allocated bit */
+        if ((long)(bp = mem_sbrk(size)) == -1)
+            return NULL;
+    } else {
+        if ((long)(bp = mem_sbrk(size + 4*WSIZE)) == -1)
+            return NULL;
+        PUT(bp, 0);                                         /* Alignment padding */
+        PUT(bp + (1*WSIZE), PACK(DSIZE, 1) | PREV_ALLOC);   /* Prologue header */
+        PUT(bp + (2*WSIZE), PACK(DSIZE, 1) | PREV_ALLOC);   /* Prologue footer */
+        PUT(bp + (3*WSIZE), PREV_ALLOC);                    /* Block header */
+        bp += 4*WSIZE;
+    }
 
     /* Initialize free block header/footer and the epilogue header */
-    PUT(HDRP(bp), PACK(size, 0));           /* Free block header */
-    PUT(FTRP(bp), PACK(size, 0));           /* Free block footer */
-    PUTADDR(PRED(bp), 0);
-    PUTADDR(SUCC(bp), 0);
+    set_block(bp, size, 0);                 /* Free block header/footer */
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));   /* New epilogue header */
+    arena->top = NEXT_BLKP(bp);
+    arena->idle = 0;
 
     /* Coalesce if the previous block is free */
     return coalesce(bp);
 }
 
 /*
- * mm_malloc - Allocate a block by incrementing the brk pointer.
- *     Always allocate a block whose size is a multiple of the alignment.
+ * adjust_size - block size for a request: the payload plus the header,
+ *     rounded up to the alignment and at least MIN_BLOCK
  */
-void *mm_malloc(size_t size)
+static size_t adjust_size(size_t size)
 {
-    size_t asize;       /* Adjusted block size */
-    size_t extendsize;  /* Amount to extend heap if no fit */
-    char *bp;
+    return MAX(ALIGN(size + OVERHEAD), MIN_BLOCK);
+}
 
-    /* Handle coalescing-bal. Save metadata into the last byte of the block. */
-    if (size == 4095) {
-        bp = heap_listp + 4 + 4095;
-        char *temp = bp + 1;
-        if (GET_SIZE(temp) == 0 && GET_ALLOC(temp)) {
-            if (extend_heap(CHUNKSIZE/WSIZE + 1) == NULL)
-                return NULL;
-        }
-        bp = bp + 4;
-        if (*bp != (char) ~0) {
-            *bp = (char)~0;
-            bp = bp - 4095;
-            return bp;
-        } else {
-            bp = bp + 4096;
-            *bp = (char)~0;
-            bp = bp - 4095;
-            return bp;
+/*
+ * run_link - push run r onto the list of runs with free objects of class cls
+ */
+static void run_link(int cls, char *r)
+{
+    PUTLINK(RUN_PREV(r), NULL);
+    PUTLINK(RUN_NEXT(r), arena->slab_runs[cls]);
+    if (arena->slab_runs[cls] != NULL)
+        PUTLINK(RUN_PREV(arena->slab_runs[cls]), r);
+    arena->slab_runs[cls] = r;
+}
+
+/*
+ * run_unlink - remove run r from the list of runs of class cls
+ */
+static void run_unlink(int cls, char *r)
+{
+    char *prev = GETLINK(RUN_PREV(r));
+    char *next = GETLINK(RUN_NEXT(r));
+
+    if (prev != NULL)
+        PUTLINK(RUN_NEXT(prev), next);
+    else
+        arena->slab_runs[cls] = next;
+    if (next != NULL)
+        PUTLINK(RUN_PREV(next), prev);
+}
+
+/*
+ * run_of - the run that ptr is an object of, or NULL for a block of its
+ *     own. run_map has an entry for every RUN_SIZE page of the heap: the
+ *     offset in double words, plus one, of the run that starts in the page,
+ *     or 0. A run spans at most two pages, so the run of ptr starts in the
+ *     page of ptr or in the one before it. It takes no lock.
+ */
+static char *run_of(void *ptr)
+{
+    run_map_t *map = __atomic_load_n(&run_map, __ATOMIC_ACQUIRE);
+    size_t page = ((char *)ptr - heap_base) / RUN_SIZE;
+    size_t p;
+    unsigned short e;
+    char *r;
+
+    if (map == NULL)
+        return NULL;
+    for (int i = 0; i < 2 && i <= page; i++) {
+        p = page - i;
+        if (p >= map->len || (e = __atomic_load_n(&map->page[p], __ATOMIC_RELAXED)) == 0)
+            continue;
+        r = heap_base + p * RUN_SIZE + (e - 1) * DSIZE;
+        if ((char *)ptr > r && (char *)ptr < r + RUN_SIZE)
+            return r;
+    }
+    return NULL;
+}
+
+/*
+ * run_map_set - set the entry of page in run_map, and grow the map if it
+ *     doesn't cover page. The map is a block in the heap and at least
+ *     doubles, so it is copied O(log n) times. An old map is never freed:
+ *     run_of may still be reading it in another thread.
+ *
+ * return 0 on success, -1 if the heap is out of memory
+ */
+static int run_map_set(size_t page, unsigned short val)
+{
+    run_map_t *map;
+    size_t len;
+
+    pthread_mutex_lock(&map_lock);
+    map = run_map;
+    if (map == NULL || page >= map->len) {
+        len = MAX(map != NULL ? 2 * map->len : 0, page + 1);
+        len = sizeof(run_map_t) + len * sizeof(map->page[0]);
+        if ((map = block_alloc(adjust_size(len))) == NULL) {
+            pthread_mutex_unlock(&map_lock);
+            return -1;
         }
+        memset(map, 0, len);
+        map->len = (len - sizeof(run_map_t)) / sizeof(map->page[0]);
+        if (run_map != NULL)
+            memcpy(map->page, run_map->page, run_map->len * sizeof(map->page[0]));
+        __atomic_store_n(&run_map, map, __ATOMIC_RELEASE);
     }
+    __atomic_store_n(&map->page[page], val, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&map_lock);
+    return 0;
+}
 
-    if (size == 8190) {
-        bp = heap_listp + 4 + 4 + 8191;
-        *bp = (char)~0;
-        bp = bp - 8191;
-        return bp;
+/*
+ * run_new - allocate a run for objects of class cls, every object free
+ */
+static char *run_new(int cls)
+{
+    size_t osize = (cls + 1) * DSIZE;
+    int n = RUN_NOBJS(osize);
+    char *r;
+
+    if ((r = block_alloc(RUN_SIZE)) == NULL)
+        return NULL;
+    if (run_map_set((r - heap_base) / RUN_SIZE,
+                    (r - heap_base) % RUN_SIZE / DSIZE + 1) < 0) {
+        block_free(r);
+        return NULL;
     }
 
-    /* Ignore spurious requests */
-    if (size == 0)
+    PUT(RUN_OSIZE(r), osize);
+    PUT(RUN_NFREE(r), n);
+    for (int w = 0; w < RUN_MAP_WORDS; w++, n -= 64)
+        RUN_MAP(r)[w] = n >= 64 ? ~0UL : n > 0 ? (1UL << n) - 1 : 0;
+    run_link(cls, r);
+    return r;
+}
+
+/*
+ * slab_alloc - allocate an object of class cls: the first free object of
+ *     the first run of the class with one
+ */
+static void *slab_alloc(int cls)
+{
+    unsigned long *map;
+    char *r;
+    int w, i;
+
+    if ((r = arena->slab_runs[cls]) == NULL && (r = run_new(cls)) == NULL)
         return NULL;
 
-    /* Adjust block size to include overhead(header, footer and pointers) and alignment reqs */
-    if (size <= DSIZE)
-        asize = 3 * DSIZE;
-    else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
-
-    /* Handle binary2, alloc small and big block into different free block */
-    if (GET_SIZE(HDRP(NEXT_BLKP(heap_listp))) == 16 + OVERHEAD || GET_SIZE(HDRP(NEXT_BLKP(heap_listp))) == 64 + OVERHEAD) {
-        /* Alloc small block in the first free block */
-        if (size == 16 || size == 64) {
-            if ((bp = find_first_fit(asize)) != NULL) {
-                place(bp, asize);
-                return bp;
-            }
-        }
+    map = RUN_MAP(r);
+    for (w = 0; map[w] == 0; w++)
+        ;
+    i = __builtin_ctzl(map[w]);
+    map[w] &= map[w] - 1;
+    PUT(RUN_NFREE(r), GET(RUN_NFREE(r)) - 1);
+    if (GET(RUN_NFREE(r)) == 0)
+        run_unlink(cls, r);
+    return RUN_OBJS(r) + (w * 64 + i) * (size_t)GET(RUN_OSIZE(r));
+}
 
-        /* Alloc big block in the last free block */
-        if (size == 112 || size == 448) {
-            if ((bp = find_last_fit(asize)) != NULL) {
-                /* Init two separate big free block */
-                int binary_size = GET_SIZE(HDRP(PREV_BLKP(bp)));
-                if (binary_size == 16 + OVERHEAD || binary_size == 64 + OVERHEAD) {
-                    /* Extend heap to max required size in realloc-bal */
-                    size_t first_size = 0;
-                    if (binary_size == 16 + OVERHEAD) {
-                        first_size = (16 + OVERHEAD)*4000;
-                        if (extend_heap(156 * CHUNKSIZE/WSIZE) == NULL)
-                            return NULL;
-                    } else {
-                        first_size = (64+OVERHEAD)*2000;
-                        if (extend_heap(289 * CHUNKSIZE/WSIZE) == NULL)
-                            return NULL;
-                    }
-                    char *retptr;
-                    size_t csize = GET_SIZE(HDRP(bp));
-                    remove_block(bp);
-                    PUT(HDRP(bp), PACK(first_size, 0));
-                    PUT(FTRP(bp), PACK(first_size, 0));
-                    insert_block(bp);
-                    bp = NEXT_BLKP(bp);
-                    PUT(HDRP(bp), PACK(asize, 1));
-                    PUT(FTRP(bp), PACK(asize, 1));
-                    retptr = bp;
-                    bp = NEXT_BLKP(bp);
-                    PUT(HDRP(bp), PACK(csize-asize-first_size, 0));
-                    PUT(FTRP(bp), PACK(csize-asize-first_size, 0));
-                    insert_block(bp);
-                    return retptr;
-                }
-                place(bp, asize);
-                return bp;
+/*
+ * slab_free - free object ptr of run r. A run that becomes empty goes back
+ *     to the heap, unless it is the only run of its class with free objects
+ *     (so one object allocated and freed over and over doesn't make and
+ *     destroy a run every time).
+ */
+static void slab_free(char *r, void *ptr)
+{
+    size_t osize = GET(RUN_OSIZE(r));
+    int cls = SLAB_CLASS(osize);
+    size_t i = ((char *)ptr - RUN_OBJS(r)) / osize;
+    unsigned int nfree = GET(RUN_NFREE(r)) + 1;
+
+    RUN_MAP(r)[i / 64] |= 1UL << (i % 64);
+    PUT(RUN_NFREE(r), nfree);
+    if (nfree == 1) {
+        run_link(cls, r);
+    } else if (nfree == (unsigned int)RUN_NOBJS(osize) &&
+               (arena->slab_runs[cls] != r || GETLINK(RUN_NEXT(r)) != NULL)) {
+        run_unlink(cls, r);
+        run_map_set((r - heap_base) / RUN_SIZE, 0);
+        block_free(r);
+    }
+}
+
+/*
+ * tcache_sync - empty the thread cache if it holds objects of an old heap
+ *     (mm_init was called since it was filled)
+ */
+static void tcache_sync(void)
+{
+    if (tcache.gen != heap_gen) {
+        get_arena();
+        memset(&tcache, 0, sizeof(tcache));
+        tcache.gen = heap_gen;
+    }
+}
+
+/*
+ * tcache_get - take a free object of class cls from the thread cache
+ *
+ * return NULL if the cache of the class is empty
+ */
+static void *tcache_get(int cls)
+{
+    void *p;
+
+    tcache_sync();
+    if ((p = tcache.list[cls]) != NULL) {
+        tcache.list[cls] = NEXT_OBJ(p);
+        tcache.count[cls]--;
+    }
+    return p;
+}
+
+/*
+ * tcache_fill - move free objects of class cls from the runs of the locked
+ *     arena to the thread cache, without starting a run
+ */
+static void tcache_fill(int cls)
+{
+    void *p;
+
+    tcache_sync();
+    while (tcache.count[cls] < TCACHE_FILL && arena->slab_runs[cls] != NULL) {
+        p = slab_alloc(cls);
+        NEXT_OBJ(p) = tcache.list[cls];
+        tcache.list[cls] = p;
+        tcache.count[cls]++;
+    }
+}
+
+/*
+ * tcache_flush - give n objects of class cls in the thread cache back to
+ *     their runs, taking the lock of each arena once
+ */
+static void tcache_flush(int cls, int n)
+{
+    void *list = NULL, *p, *next;
+    arena_t *a;
+    char *run;
+    int locked;
+
+    while (n-- > 0 && (p = tcache.list[cls]) != NULL) {
+        tcache.list[cls] = NEXT_OBJ(p);
+        tcache.count[cls]--;
+        NEXT_OBJ(p) = list;
+        list = p;
+    }
+    while (list != NULL) {
+        a = &arenas[GET_ARENA(HDRP(run_of(list)))];
+        locked = arena_try(a);
+        for (p = list, list = NULL; p != NULL; p = next) {
+            next = NEXT_OBJ(p);
+            run = run_of(p);
+            if (&arenas[GET_ARENA(HDRP(run))] != a) {
+                NEXT_OBJ(p) = list;
+                list = p;
+            } else if (locked) {
+                slab_free(run, p);
+            } else {
+                remote_push(a, p);
             }
         }
+        if (locked)
+            arena_unlock();
+    }
+}
+
+/*
+ * tcache_put - put free object ptr of class cls in the thread cache, and
+ *     make room for it if the cache of the class is full
+ */
+static void tcache_put(int cls, void *ptr)
+{
+    tcache_sync();
+    if (tcache.count[cls] == TCACHE_MAX)
+        tcache_flush(cls, TCACHE_MAX / 2);
+    NEXT_OBJ(ptr) = tcache.list[cls];
+    tcache.list[cls] = ptr;
+    tcache.count[cls]++;
+}
+
+/*
+ * tcache_destroy - flush the cache of an exiting thread
+ */
+static void tcache_destroy(void *unused)
+{
+    tcache_sync();
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        tcache_flush(i, tcache.count[i]);
+}
+
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * get_arena - the arena of this thread; a new thread gets the next arena
+ *     in turn
+ */
+static arena_t *get_arena(void)
+{
+    if (thread_arena == NULL) {
+        pthread_once(&tcache_once, tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+        thread_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % ARENA_NUM];
     }
+    return thread_arena;
+}
 
-    /* Search the free list for a fit */
-    if ((bp = find_fit(asize)) != NULL) {
-        place(bp, asize);
-        return bp;
+/*
+ * remote_push - put block ptr of arena a, freed by a thread that couldn't
+ *     get its lock, on the remote queue of a. The queue is a stack that
+ *     any thread pushes on with a CAS, and only the holder of the lock
+ *     takes as a whole, so it has no ABA problem.
+ */
+static void remote_push(arena_t *a, void *ptr)
+{
+    void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+
+    do {
+        NEXT_OBJ(ptr) = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * arena_enter - make a, just locked, the arena of this thread's requests,
+ *     and free the blocks on its remote queue
+ */
+static void arena_enter(arena_t *a)
+{
+    void *p, *next;
+    char *run;
+
+    arena = a;
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL)
+        return;
+    p = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    for (; p != NULL; p = next) {
+        next = NEXT_OBJ(p);
+        if ((run = run_of(p)) != NULL)
+            slab_free(run, p);
+        else
+            block_free(p);
     }
+}
 
-    /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize, CHUNKSIZE);
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
-        return NULL;
+static void arena_lock(arena_t *a)
+{
+    pthread_mutex_lock(&a->lock);
+    arena_enter(a);
+}
 
-    /* Handle realloc2-bal, leave two small block in the first heap block */
-    if (size == 4092) {
-        char *retptr;
-        bp = NEXT_BLKP(heap_listp);
-        size_t csize = GET_SIZE(HDRP(bp));
-        remove_block(bp);
-        PUT(HDRP(bp), PACK((16+OVERHEAD)*2, 0));
-        PUT(FTRP(bp), PACK((16+OVERHEAD)*2, 0));
-        insert_block(bp);
-        bp = NEXT_BLKP(bp);
-        PUT(HDRP(bp), PACK(asize, 1));
-        PUT(FTRP(bp), PACK(asize, 1));
-        retptr = bp;
-        bp = NEXT_BLKP(bp);
-        PUT(HDRP(bp), PACK(csize-asize-(16+OVERHEAD)*2, 0));
-        PUT(FTRP(bp), PACK(csize-asize-(16+OVERHEAD)*2, 0));
-        insert_block(bp);
-        return retptr;
+/*
+ * arena_try - lock arena a, waiting for the lock only if a is the arena
+ *     of this thread
+ *
+ * return 1 if a is locked, 0 otherwise
+ */
+static int arena_try(arena_t *a)
+{
+    if (pthread_mutex_trylock(&a->lock) != 0) {
+        if (a != get_arena())
+            return 0;
+        pthread_mutex_lock(&a->lock);
     }
-    place(bp, asize);
+    arena_enter(a);
+    return 1;
+}
+
+static void arena_unlock(void)
+{
+    pthread_mutex_unlock(&arena->lock);
+    arena = NULL;
+}
+
+/*
+ * mm_malloc - Allocate a small request from the thread cache, or take
+ *     the lock of the arena of the thread.
+ */
+void *mm_malloc(size_t size)
+{
+    void *bp;
+
+    /* Ignore spurious requests */
+    if (size == 0)
+        return NULL;
+    if (size >= MMAP_THRESHOLD)
+        return huge_alloc(size);
+    if (size > SIZE_MASK - DSIZE)
+        return NULL;
 
+    if (size <= SLAB_MAX && (bp = tcache_get(SLAB_CLASS(size))) != NULL)
+        return bp;
+    arena_lock(get_arena());
+    bp = arena_malloc(size);
+    arena_unlock();
     return bp;
 }
 
 /*
- * find_first_fit - search first fit free block in the heap
+ * arena_malloc - Allocate an object of a run for a small request once many
+ *     small blocks are live (and fill the thread cache from the runs),
+ *     otherwise a block from the free lists, or from the top of the heap
+ *     if no free block fits.
+ *     Always allocate a block whose size is a multiple of the alignment.
  */
-static void *find_first_fit(size_t asize) {
+static void *arena_malloc(size_t size)
+{
+    int cls = SLAB_CLASS(size);
     void *bp;
 
-    /* First-fit search*/
-    for (bp = heap_listp ; bp != NULL ; bp = NEXT_BLKP(bp)) {
-        if (!GET_ALLOC(HDRP(bp)) && asize <= GET_SIZE(HDRP(bp))) {
+    if (size <= SLAB_MAX) {
+        if (arena->slab_runs[cls] != NULL || arena->small_live >= SLAB_START) {
+            if ((bp = slab_alloc(cls)) != NULL)
+                tcache_fill(cls);
             return bp;
         }
+        arena->small_live++;
     }
-    return NULL;
+    return block_alloc(adjust_size(size));
 }
 
 /*
- * find_last_fit - search last fit free block in the heap
+ * block_alloc - allocate a block of asize bytes (an adjusted size)
  */
-static void *find_last_fit(size_t asize) {
-    /* Last-fit free block */
-    return PREV_BLKP(mem_sbrk(0));
+static void *block_alloc(size_t asize)
+{
+    char *bp;
+
+    /* Search the free list for a fit */
+    if ((bp = find_fit(asize)) == NULL) {
+        /* No fit found. Get more memory and place the block */
+        if ((bp = grow_heap(asize)) == NULL)
+            return NULL;
+    }
+    return place(bp, asize);
 }
 
+/*
+ * grow_heap - extend the heap so that the last block of the arena is a
+ *     free block of at least asize bytes. A free block at the top of the
+ *     heap only grows by what it lacks, so no chunk is wasted behind it.
+ */
+static void *grow_heap(size_t asize)
+{
+    char *top, *bp;
+    int last_free;
+    size_t words;
+
+    pthread_mutex_lock(&brk_lock);
+    top = arena->top;
+    last_free = top == (char *)mem_heap_hi() + 1 && !GET_PREV_ALLOC(HDRP(top));
+    if (last_free)
+        asize -= GET_SIZE(HDRP(PREV_BLKP(top)));
+    words = MAX(asize, MIN_BLOCK) / WSIZE;
+    if (asize < CHUNKSIZE && !last_free)
+        words = CHUNKSIZE / WSIZE;
+    bp = extend_heap(words);
+    pthread_mutex_unlock(&brk_lock);
+    return bp;
+}
 
 /*
- * find_fit - search first fit free block in the free list
+ * find_fit - search a fit free block in the free lists: the best fit among
+ *     the first FIT_CANDIDATES fits, starting at the list of asize, and an
+ *     exact fit right away. Empty lists are skipped with list_map, and
+ *     every block of a list above the one of asize fits. Without a fit in
+ *     the lists, the best fit is the one in the tree of large blocks.
  */
 static void *find_fit(size_t asize)
 {
-    void *bp;
-
-    /* First-fit search in the corresponding free list */
-    int index = get_block_index(asize);
-    for (int i=index; i<LIST_NUM ; i++) {
-        for (bp = free_listp[i] ; bp != NULL ; bp = NEXT_FBLKP(bp)) {
-            if (asize <= GET_SIZE(HDRP(bp))) {
+    void *bp, *best = NULL;
+    size_t csize, best_size = 0;
+    int candidates = 0;
+    unsigned long map;
+    int i;
+
+    map = asize < TREE_MIN ? arena->list_map & (~0UL << get_block_index(asize)) : 0;
+    while (map != 0) {
+        i = __builtin_ctzl(map);
+        for (bp = arena->free_listp[i] ; bp != NULL ; bp = NEXT_FBLKP(bp)) {
+            csize = GET_SIZE(HDRP(bp));
+            if (asize > csize)
+                continue;
+            if (csize == asize)
                 return bp;
+            if (best == NULL || csize < best_size) {
+                best = bp;
+                best_size = csize;
             }
+            if (++candidates == FIT_CANDIDATES)
+                return best;
         }
+        /* a fit in a smaller list beats any block of the larger lists */
+        if (best != NULL)
+            return best;
+        map &= map - 1;
     }
-    return NULL;
+    return tree_fit(asize);
 }
 
-static void place(void *bp, size_t asize)
+/*
+ * place - allocate asize bytes of free block bp and return the allocated
+ *     block. Small blocks are cut from the front of bp and large blocks
+ *     (at least SPLIT_BACK bytes) from its end, so small and large objects
+ *     don't interleave and freed large blocks coalesce with each other.
+ */
+static void *place(void *bp, size_t asize)
 {
     size_t csize = GET_SIZE(HDRP(bp));
 
-    /* Free block can be splitted? */
-    if ((csize - asize) >= (3 * DSIZE)) {
-        remove_block(bp);
-        PUT(HDRP(bp), PACK(asize, 1));
-        PUT(FTRP(bp), PACK(asize, 1));
-        bp = NEXT_BLKP(bp);
-        PUT(HDRP(bp), PACK(csize-asize, 0));
-        PUT(FTRP(bp), PACK(csize-asize, 0));
+    remove_block(bp);
+
+    /* Free block can't be splitted? */
+    if ((csize - asize) < MIN_BLOCK) {
+        set_block(bp, csize, 1);
+        return bp;
+    }
+
+    if (asize >= SPLIT_BACK) {
+        set_block(bp, csize-asize, 0);
         insert_block(bp);
+        bp = NEXT_BLKP(bp);
+        set_block(bp, asize, 1);
     } else {
-        remove_block(bp);
-        PUT(HDRP(bp), PACK(csize, 1));
-        PUT(FTRP(bp), PACK(csize, 1));
+        set_block(bp, asize, 1);
+        set_block(NEXT_BLKP(bp), csize-asize, 0);
+        insert_block(NEXT_BLKP(bp));
     }
+    return bp;
+}
+
+/*
+ * map_size - size of the region for a mapped block of size bytes: the
+ *     block and what comes before it, rounded up to whole pages
+ */
+static size_t map_size(size_t size)
+{
+    return (size + MAP_HDR + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
 }
 
 /*
- * mm_free - Freeing a block does nothing.
+ * huge_alloc - allocate a block of size bytes in a mapped region of its
+ *     own; it takes no lock of the package
+ */
+static void *huge_alloc(size_t size)
+{
+    size_t rsize = map_size(size);
+    char *r;
+
+    if ((long)(r = mem_map(rsize)) == -1)
+        return NULL;
+    MAP_SIZE(r) = rsize;
+    PUT(HDRP(r + MAP_HDR), MAPPED | 0x1);
+    return r + MAP_HDR;
+}
+
+/*
+ * huge_realloc - resize mapped block ptr. The region is remapped, so the
+ *     payload doesn't move through memory, and only when its page count
+ *     changes. A block that shrinks well below MMAP_THRESHOLD moves to
+ *     the heap.
+ */
+static void *huge_realloc(void *ptr, size_t size)
+{
+    size_t rsize = map_size(size);
+    char *r = MAP_REGION(ptr), *newptr;
+
+    if (size < MMAP_THRESHOLD / 2) {
+        if ((newptr = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newptr, ptr, size);
+        mem_unmap(r);
+        return newptr;
+    }
+    if (rsize == MAP_SIZE(r))
+        return ptr;
+    if ((long)(r = mem_remap(r, rsize)) == -1)
+        return NULL;
+    MAP_SIZE(r) = rsize;
+    return r + MAP_HDR;
+}
+
+/*
+ * mm_free - Put an object of a run in the thread cache, unmap a mapped
+ *     block, or free a block in its arena.
  */
 void mm_free(void *ptr)
 {
-    size_t size = GET_SIZE(HDRP(ptr));
+    char *run;
 
-    /* Free block in the coalescing-bal */
-    char *bp = (char *)(ptr + 4095);
-    if (*bp == (char)~0) {
-        *bp = (char)0;
+    if ((run = run_of(ptr)) != NULL)
+        tcache_put(SLAB_CLASS(GET(RUN_OSIZE(run))), ptr);
+    else if (GET_SHARED(HDRP(ptr)) & MAPPED)
+        mem_unmap(MAP_REGION(ptr));
+    else
+        free_owned(ptr, NULL);
+}
+
+/*
+ * free_owned - free ptr, an object of run or a block if run is NULL, in
+ *     the arena it belongs to. If the lock of another thread's arena is
+ *     taken, ptr goes onto the remote queue of the arena instead.
+ */
+static void free_owned(void *ptr, char *run)
+{
+    arena_t *a = &arenas[GET_ARENA(HDRP(run != NULL ? run : (char *)ptr))];
+
+    if (!arena_try(a)) {
+        remote_push(a, ptr);
         return;
     }
+    if (run != NULL)
+        slab_free(run, ptr);
+    else
+        block_free(ptr);
+    arena_unlock();
+}
 
-    bp = (char *)(ptr + 8191);
-    if (*bp == (char)~0) {
-        *bp = (char)0;
+/*
+ * block_free - free a block of the locked arena
+ */
+static void block_free(void *bp)
+{
+    if (GET_SIZE(HDRP(bp)) <= adjust_size(SLAB_MAX) && arena->small_live > 0)
+        arena->small_live--;
+    release_block(bp);
+}
+
+/*
+ * trim_heap - cut free block bp down to TRIM_PAD bytes (in whole chunks)
+ *     if it is the last block of the heap and larger than TRIM_THRESHOLD,
+ *     and the heap has been idle for TRIM_IDLE frees, and give the rest
+ *     back with a negative mem_sbrk
+ *
+ * return bp
+ */
+static void *trim_heap(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp)), cut;
+
+    if (size <= TRIM_THRESHOLD || arena->idle < TRIM_IDLE)
+        return bp;
+    pthread_mutex_lock(&brk_lock);
+    if (NEXT_BLKP(bp) == arena->top && arena->top == (char *)mem_heap_hi() + 1) {
+        cut = (size - TRIM_PAD) & ~(size_t)(CHUNKSIZE - 1);
+        remove_block(bp);
+        set_block(bp, size - cut, 0);
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));   /* New epilogue header */
+        arena->top = NEXT_BLKP(bp);
+        insert_block(bp);
+        mem_sbrk(-(int)cut);
+    }
+    pthread_mutex_unlock(&brk_lock);
+    return bp;
+}
+
+/*
+ * release_free - release the pages of large free block bp, all but its
+ *     header, links and footer, unless they are released already
+ */
+static void release_free(char *bp)
+{
+    char *lo;
+
+    if (GET_SIZE(HDRP(bp)) < RELEASE_MIN || (GET(HDRP(bp)) & RELEASED))
         return;
+    lo = bp + DSIZE;
+    mem_release(lo, FTRP(bp) - lo);
+    PUT(HDRP(bp), GET(HDRP(bp)) | RELEASED);
+}
+
+/*
+ * release_tree - release the pages of the large free blocks in the
+ *     subtree bp of the tree. The walk is in order without a stack: the
+ *     rightmost block of a left subtree links back to its successor for
+ *     the time the subtree is walked (a Morris traversal), so a tree as
+ *     deep as it is large takes no more space than a balanced one.
+ */
+static void release_tree(char *bp)
+{
+    char *pre;
+
+    while (bp != NULL) {
+        if (LEFT(bp) == NULL) {
+            release_free(bp);
+            bp = RIGHT(bp);
+            continue;
+        }
+        for (pre = LEFT(bp); RIGHT(pre) != NULL && RIGHT(pre) != bp; pre = RIGHT(pre))
+            ;
+        if (RIGHT(pre) == NULL) {   /* First visit: link back, walk left */
+            SET_RIGHT(pre, bp);
+            bp = LEFT(bp);
+        } else {                    /* Left subtree done: unlink, go right */
+            SET_RIGHT(pre, NULL);
+            release_free(bp);
+            bp = RIGHT(bp);
+        }
     }
+}
 
+/*
+ * release_block - free allocated block bp, coalesce it with its free
+ *     neighbors, and give memory back: trim the heap, and release the
+ *     pages of every large free block of the arena once enough has been
+ *     freed into them
+ */
+static void release_block(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
 
-    PUT(HDRP(ptr), PACK(size, 0));
-    PUT(FTRP(ptr), PACK(size, 0));
-    PUTADDR(PRED(ptr), 0);
-    PUTADDR(SUCC(ptr), 0);
-    coalesce(ptr);
+    set_block(bp, size, 0);
+    arena->idle++;
+    bp = trim_heap(coalesce(bp));
+    if (GET_SIZE(HDRP(bp)) < RELEASE_MIN)
+        return;
+    arena->dirty += size;
+    if (arena->dirty >= RELEASE_DIRTY) {
+        release_tree(arena->tree_root);
+        arena->dirty = 0;
+    }
 }
 
 static void *coalesce(void *bp)
 {
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
 
@@ -460,31 +1321,50 @@ static void *coalesce(void *bp)
     }else if(prev_alloc && !next_alloc) {       /* Coalesce with next free block */
         remove_block(NEXT_BLKP(bp));
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(bp), PACK(size, 0));
-        PUT(FTRP(bp), PACK(size, 0));
+        set_block(bp, size, 0);
     }else if(!prev_alloc && next_alloc) {       /* Coalesce with prev free block */
         remove_block(PREV_BLKP(bp));
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-        PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
         bp = PREV_BLKP(bp);
+        set_block(bp, size, 0);
     }else{                                      /* Coalesce with prev and next free block */
         remove_block(PREV_BLKP(bp));
         remove_block(NEXT_BLKP(bp));
-        size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+        size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp)));
         bp = PREV_BLKP(bp);
+        set_block(bp, size, 0);
     }
     insert_block(bp);
     return bp;
 }
 
+
+/*
+ * shrink_block - cut allocated block bp down to asize bytes and free the
+ *     rest of it, if the rest is big enough to be a block
+ */
+static void shrink_block(void *bp, size_t asize)
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+
+    if ((csize - asize) < MIN_BLOCK)
+        return;
+    set_block(bp, asize, 1);
+    bp = NEXT_BLKP(bp);
+    set_block(bp, csize-asize, 1);
+    release_block(bp);
+}
+
 /*
- * mm_realloc - Check if csize can be the reallocated space before call mm_malloc and mm_free.
+ * mm_realloc - Keep an object of a run while it fits its size class, remap
+ *     a mapped block, and move a block of another arena unless it still
+ *     fits. Resize a block of the arena of the thread with its lock held.
  */
 void *mm_realloc(void *ptr, size_t size)
 {
+    size_t csize;
+    char *newptr, *run;
+
     if (size == 0) {
         mm_free(ptr);
         return ptr;
@@ -494,186 +1374,323 @@ void *mm_realloc(void *ptr, size_t size)
         return mm_malloc(size);
     }
 
-    size_t asize = 0;
-    size_t csize = GET_SIZE(HDRP(ptr));
-    if (size <= DSIZE)
-        asize = 3 * DSIZE;
-    else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
+    /* An object of a run: keep it while it fits its class, otherwise move */
+    if ((run = run_of(ptr)) != NULL) {
+        csize = GET(RUN_OSIZE(run));
+        if (size <= csize)
+            return ptr;
+        if ((newptr = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newptr, ptr, csize);
+        mm_free(ptr);
+        return newptr;
+    }
 
+    if (GET_SHARED(HDRP(ptr)) & MAPPED)
+        return huge_realloc(ptr, size);
 
-    if ((csize >= asize) && (csize < asize + 3 * DSIZE)) {  /* Csize is enough space for reallocated block */
-        return ptr;
-    } else if(csize >= asize + 3 * DSIZE) {                 /* Csize should be split */
-        size_t diff = csize - asize;
-        void *next_block = NEXT_BLKP(ptr);
-        PUT(HDRP(ptr), PACK(asize, 1));
-        PUT(FTRP(ptr), PACK(asize, 1));
-        void *remain_block = NEXT_BLKP(ptr);
-
-        if (GET_ALLOC(HDRP(next_block))) {          /* No coalescing with next block */
-            PUT(HDRP(remain_block), PACK(diff, 0));
-            PUT(FTRP(remain_block), PACK(diff, 0));
-            PUTADDR(PRED(remain_block), 0);
-            PUTADDR(SUCC(remain_block), 0);
-            insert_block(remain_block);
-        } else {                                    /* Coalescing with next free block */
-            remove_block(next_block);
-            diff += GET_SIZE(HDRP(next_block));
-            PUT(HDRP(remain_block), PACK(diff, 0));
-            PUT(FTRP(remain_block), PACK(diff, 0));
-            PUTADDR(PRED(remain_block), 0);
-            PUTADDR(SUCC(remain_block), 0);
-            insert_block(remain_block);
-        }
-        return ptr;
-    } else {                                            /* Block should be extended for reallocated space */
-        /* Extend heap when origin block is before the epilogue */
-        if (GET_SIZE(HDRP(NEXT_BLKP(ptr))) == 0 && GET_ALLOC(HDRP(NEXT_BLKP(ptr)))) {
-            if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
-                return NULL;
-        }
+    /* Too big for a block: move to a region */
+    if (size > SIZE_MASK - DSIZE) {
+        if (size < MMAP_THRESHOLD || (newptr = huge_alloc(size)) == NULL)
+            return NULL;
+        memcpy(newptr, ptr, (GET_SHARED(HDRP(ptr)) & SIZE_MASK) - OVERHEAD);
+        mm_free(ptr);
+        return newptr;
+    }
 
-        /* Extend heap when origin block is before the free block, which is before epilogue */
-        if (GET_SIZE(HDRP(NEXT_BLKP(heap_listp))) != (16+OVERHEAD) && GET_SIZE(HDRP(NEXT_BLKP(ptr))) > 600 &&
-            GET_SIZE(HDRP(NEXT_BLKP(ptr))) <= 1000 && GET_ALLOC(HDRP(NEXT_BLKP(NEXT_BLKP(ptr)))) &&
-            GET_SIZE(HDRP(NEXT_BLKP(NEXT_BLKP(ptr)))) == 0) {
-            if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
-                return NULL;
-        }
+    /* A block of another arena: its neighbors aren't ours to take */
+    if (&arenas[GET_ARENA(HDRP(ptr))] != get_arena()) {
+        csize = GET_SHARED(HDRP(ptr)) & SIZE_MASK;
+        if (adjust_size(size) <= csize)
+            return ptr;
+        if ((newptr = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newptr, ptr, csize - OVERHEAD);
+        mm_free(ptr);
+        return newptr;
+    }
 
-        if (GET_SIZE(HDRP(NEXT_BLKP(heap_listp))) == (16+OVERHEAD) && GET_SIZE(HDRP(NEXT_BLKP(ptr))) > 2*(16+OVERHEAD) &&
-            GET_SIZE(HDRP(NEXT_BLKP(ptr))) <= 2*(16+OVERHEAD+20) && GET_ALLOC(HDRP(NEXT_BLKP(NEXT_BLKP(ptr)))) &&
-            GET_SIZE(HDRP(NEXT_BLKP(NEXT_BLKP(ptr)))) == 0) {
-            if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
-                return NULL;
-        }
+    arena_lock(get_arena());
+    newptr = block_realloc(ptr, size);
+    arena_unlock();
+    return newptr;
+}
 
+/*
+ * block_realloc - Resize a block in place when its neighbors allow it:
+ *     it keeps its headroom when it shrinks a little, takes the next free
+ *     block, slides back into a free previous block, or grows the heap
+ *     when it is the last block. Sliding back comes before growing the
+ *     heap, so the hole a block leaves when it moves to the top of the
+ *     heap is filled again rather than kept. Otherwise it moves to a new
+ *     block, with headroom for the next growth if it was moved before, or
+ *     to a mapped region once it is huge, where it grows by remapping.
+ */
+static void *block_realloc(void *ptr, size_t size)
+{
+    size_t asize, csize, nsize, psize, room, take, head;
+    char *next, *prev, *newptr;
 
+    asize = adjust_size(size);
+    csize = GET_SIZE(HDRP(ptr));
 
-        void *next_block = NEXT_BLKP(ptr);
-
-        /* Need coalescing? */
-        if (!GET_ALLOC(HDRP(next_block))) {
-            size_t tot_size = csize + GET_SIZE(HDRP(next_block));
-            /* Coalescing current block and next free block to be the reallocated block */
-            if (tot_size >= asize) {
-                remove_block(next_block);
-                size_t diff = tot_size - asize;
-                /* Need splitting? */
-                if (diff < 3 * DSIZE) {
-                    PUT(HDRP(ptr), PACK(tot_size, 1));
-                    PUT(FTRP(ptr), PACK(tot_size, 1));
-                } else {
-                    PUT(HDRP(ptr), PACK(asize, 1));
-                    PUT(FTRP(ptr), PACK(asize, 1));
-                    PUT(HDRP(NEXT_BLKP(ptr)), PACK(diff, 0));
-                    PUT(FTRP(NEXT_BLKP(ptr)), PACK(diff, 0));
-                    PUTADDR(PRED(NEXT_BLKP(ptr)), 0);
-                    PUTADDR(SUCC(NEXT_BLKP(ptr)), 0);
-                    insert_block(NEXT_BLKP(ptr));
-                }
-                return ptr;
-            } else if (GET_SIZE(HDRP(NEXT_BLKP(NEXT_BLKP(ptr)))) == 0 && GET_ALLOC(HDRP(NEXT_BLKP(NEXT_BLKP(ptr))))) {
-                if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
-                    return NULL;
-                next_block = NEXT_BLKP(ptr);
-                tot_size = tot_size + CHUNKSIZE;
-                if (tot_size >= asize) {
-                    remove_block(next_block);
-                    size_t diff = tot_size - asize;
-                    /* Need splitting? */
-                    if (diff < 3 * DSIZE) {
-                        PUT(HDRP(ptr), PACK(tot_size, 1));
-                        PUT(FTRP(ptr), PACK(tot_size, 1));
-                    } else {
-                        PUT(HDRP(ptr), PACK(asize, 1));
-                        PUT(FTRP(ptr), PACK(asize, 1));
-                        PUT(HDRP(NEXT_BLKP(ptr)), PACK(diff, 0));
-                        PUT(FTRP(NEXT_BLKP(ptr)), PACK(diff, 0));
-                        PUTADDR(PRED(NEXT_BLKP(ptr)), 0);
-                        PUTADDR(SUCC(NEXT_BLKP(ptr)), 0);
-                        insert_block(NEXT_BLKP(ptr));
-                    }
-                    return ptr;
-                }
-            }
+    /* Shrink: give the tail back only if the block is mostly unused */
+    if (asize <= csize) {
+        if (asize < csize / 2)
+            shrink_block(ptr, asize);
+        return ptr;
+    }
+
+    /* Space right after the block: the next block if it is free */
+    next = NEXT_BLKP(ptr);
+    nsize = csize;
+    if (!GET_ALLOC(HDRP(next))) {
+        nsize += GET_SIZE(HDRP(next));
+        next = NEXT_BLKP(next);
+    }
+
+    /* Grow in place */
+    if (nsize >= asize) {
+        if (nsize > csize) {
+            remove_block(NEXT_BLKP(ptr));
+            set_block(ptr, nsize, 1);
         }
+        shrink_block(ptr, asize);
+        return ptr;
+    }
 
-        void *newptr = mm_malloc(size);
-        if (newptr == NULL) {
-            return NULL;
+    /* Slide back into the previous block if it is free, only by what the
+       block lacks and its headroom, so the front of the previous block
+       stays free for the blocks that sit there. A block at the top of the
+       heap takes at most half of it: the heap can grow under the block,
+       while blocks that find no room in front of it would be placed after
+       it and keep it from growing. */
+    prev = GET_PREV_ALLOC(HDRP(ptr)) ? NULL : PREV_BLKP(ptr);
+    psize = prev ? GET_SIZE(HDRP(prev)) : 0;
+    room = psize;
+    if (GET_SIZE(HDRP(next)) == 0)
+        room = psize < 2 * adjust_size(SLAB_MAX) ? 0 : (psize / 2) & ~(size_t)(DSIZE - 1);
+    head = ptr == arena->moved ? ALIGN(asize / REALLOC_HEADROOM) : 0;
+    take = asize + head - nsize;
+    if (take > room)
+        take = room;
+    if (take > 0 && take + MIN_BLOCK > psize)
+        take = psize;
+    if (prev && nsize + take >= asize) {
+        remove_block(prev);
+        if (nsize > csize)
+            remove_block(NEXT_BLKP(ptr));
+        newptr = (char *)ptr - take;
+        memmove(newptr, ptr, csize - OVERHEAD);
+        if (take < psize) {
+            set_block(prev, psize - take, 0);
+            insert_block(prev);
         }
-        if (newptr != ptr)
-            memcpy(newptr, ptr, csize - DSIZE);
-        mm_free(ptr);
+        set_block(newptr, nsize + take, 1);
+        if (nsize + take > asize + head)
+            shrink_block(newptr, asize + head);
+        arena->moved = newptr;
         return newptr;
     }
+
+    /* The block reaches the top of the heap: grow the heap by the deficit */
+    if (GET_SIZE(HDRP(next)) == 0) {
+        pthread_mutex_lock(&brk_lock);
+        if (next == (char *)mem_heap_hi() + 1 &&
+            extend_heap(MAX(asize - nsize, MIN_BLOCK) / WSIZE) != NULL)
+            nsize = csize + GET_SIZE(HDRP(NEXT_BLKP(ptr)));
+        pthread_mutex_unlock(&brk_lock);
+        if (nsize >= asize) {
+            remove_block(NEXT_BLKP(ptr));
+            set_block(ptr, nsize, 1);
+            shrink_block(ptr, asize);
+            return ptr;
+        }
+    }
+
+    /* Move */
+    if (size >= MMAP_THRESHOLD)
+        newptr = huge_alloc(size);
+    else
+        newptr = arena_malloc(size + (ptr == arena->moved ? size / REALLOC_HEADROOM : 0));
+    if (newptr == NULL)
+        return NULL;
+    memcpy(newptr, ptr, csize - OVERHEAD);
+    block_free(ptr);
+    arena->moved = newptr;
+    return newptr;
 }
 
 /*
- * mm_check -  A heap checker that scans the heap and checks it for consistency.
+ * tree_check - check the subtree bp of the tree of large free blocks: its
+ *     blocks are free, large, and between lo and hi in the tree order (NULL
+ *     for no bound)
+ *
+ * return the number of blocks in the subtree, or -1 if it is broken
  */
-int mm_check()
+static int tree_check(char *bp, char *lo, char *hi)
+{
+    int nleft, nright;
+
+    if (bp == NULL)
+        return 0;
+    if (GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < TREE_MIN ||
+        (lo && tree_cmp(GET_SIZE(HDRP(lo)), lo, bp) >= 0) ||
+        (hi && tree_cmp(GET_SIZE(HDRP(hi)), hi, bp) <= 0))
+        return -1;
+    if ((nleft = tree_check(LEFT(bp), lo, bp)) < 0 ||
+        (nright = tree_check(RIGHT(bp), bp, hi)) < 0)
+        return -1;
+    return nleft + 1 + nright;
+}
+
+/*
+ * walk_next - the block after bp in a walk over every segment of the heap,
+ *     from heap_listp on: after the epilogue of a segment comes the prologue
+ *     of the next one
+ *
+ * return NULL after the last block
+ */
+static char *walk_next(char *bp)
 {
+    bp = NEXT_BLKP(bp);
+    if (GET_SIZE(HDRP(bp)) > 0)
+        return bp;
+    if (bp == (char *)mem_heap_hi() + 1)
+        return NULL;
+    return bp + 2*WSIZE;
+}
 
+/*
+ * arena_check - check the free lists, the tree and the runs of arena a
+ *
+ * return the number of free blocks in its lists and tree, or -1
+ */
+static int arena_check(arena_t *a)
+{
     char *bp;
+    int free_num = 0;
+
     /* Is every block in the free list marked as free? */
     for (int i = 0 ; i < LIST_NUM ; i++) {
-        for (bp = free_listp[i] ; bp != NULL ; bp = NEXT_FBLKP(bp)) {
+        for (bp = a->free_listp[i] ; bp != NULL ; bp = NEXT_FBLKP(bp)) {
             if (GET_ALLOC(HDRP(bp))) {
                 return -1;
             }
+            free_num++;
         }
     }
 
-    /* Are there any contiguous free blocks that somehow escaped coalescing? */
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        if (!GET_ALLOC(HDRP(bp)))
-        if (!GET_ALLOC(HDRP(bp)) && !GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
-            fprintf(stderr, "contiguous free blocks");
+    /* Does list_map match the lists, and is every block in its list? */
+    for (int i = 0 ; i < LIST_NUM ; i++) {
+        if (!(a->list_map & (1UL << i)) != !a->free_listp[i]) {
+            fprintf(stderr, "list_map out of sync with free list %d", i);
             return -1;
         }
+        for (bp = a->free_listp[i] ; bp != NULL ; bp = NEXT_FBLKP(bp)) {
+            if (get_block_index(GET_SIZE(HDRP(bp))) != i) {
+                fprintf(stderr, "free block in the wrong list");
+                return -1;
+            }
+        }
     }
 
-    /* Is every free block actually in the free list */
-    int free_num0 = 0;
-    int free_num1 = 0;
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        if (!GET_ALLOC(HDRP(bp))) {
-            free_num0++;
-        }
+    int tree_num = tree_check(a->tree_root, NULL, NULL);
+    if (tree_num < 0) {
+        fprintf(stderr, "broken tree of large free blocks");
+        return -1;
     }
-    for (int i = 0 ; i < LIST_NUM ; i++) {
-        for (bp = free_listp[i] ; bp != NULL ; bp = NEXT_FBLKP(bp)) {
-            free_num1++;
+    free_num += tree_num;
+
+    /* Is every run with free objects a run of its class, its count right? */
+    for (int i = 0 ; i < SLAB_CLASSES ; i++) {
+        for (bp = a->slab_runs[i] ; bp != NULL ; bp = GETLINK(RUN_NEXT(bp))) {
+            unsigned int nfree = 0;
+            for (int w = 0 ; w < RUN_MAP_WORDS ; w++)
+                nfree += __builtin_popcountl(RUN_MAP(bp)[w]);
+            if (!GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < RUN_SIZE ||
+                GET_ARENA(HDRP(bp)) != a->id ||
+                GET(RUN_OSIZE(bp)) != (i + 1) * DSIZE || run_of(RUN_OBJS(bp)) != bp) {
+                fprintf(stderr, "broken run in the list of its class");
+                return -1;
+            }
+            if (nfree == 0 || nfree != GET(RUN_NFREE(bp))) {
+                fprintf(stderr, "free object count of a run doesn't match its bitmap");
+                return -1;
+            }
         }
     }
-    if (free_num0 != free_num1) {
-        fprintf(stderr, "not every free block in the free list");
-        return -1;
-    }
 
     // Check the integrity of pointers in free blocks
     for (int i = 0 ; i < LIST_NUM ; i++) {
-        for (bp = free_listp[i]; bp != NULL; bp = NEXT_FBLKP(bp)) {
-            if (0 != GETADDR(PRED(free_listp[i]))) {
+        for (bp = a->free_listp[i]; bp != NULL; bp = NEXT_FBLKP(bp)) {
+            if (0 != GET(PRED(a->free_listp[i]))) {
                 fprintf(stderr, "invalid free_listp predecessot pointer");
                 return -1;
             }
 
-            if (GETADDR(PRED(bp)) == GETADDR(SUCC(bp)) && 0 != GETADDR(PRED(bp))) {
+            if (GET(PRED(bp)) == GET(SUCC(bp)) && 0 != GET(PRED(bp))) {
                 fprintf(stderr, "two pointers in one free blocks have same nonzero value");
                 return -1;
             }
 
-            if (0 != GETADDR(SUCC(bp)) &&
-                (GETADDR(SUCC(bp)) != (unsigned long) NEXT_FBLKP(bp) || GETADDR(PRED(NEXT_FBLKP(bp))) != (unsigned long) bp)) {
+            if (NEXT_FBLKP(bp) != NULL && PREV_FBLKP(NEXT_FBLKP(bp)) != bp) {
                 fprintf(stderr, "pointers of two contiguous free blocks unmatched");
                 return -1;
             }
         }
     }
 
+    return free_num;
+}
+
+/*
+ * mm_check -  A heap checker that scans the heap and checks it for consistency.
+ *     No other thread may be using the package.
+ */
+int mm_check()
+{
+
+    char *bp;
+
+    /* Are there any contiguous free blocks that somehow escaped coalescing? */
+    for (bp = heap_listp; bp != NULL; bp = walk_next(bp)) {
+        if (!GET_ALLOC(HDRP(bp)) && !GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
+            fprintf(stderr, "contiguous free blocks");
+            return -1;
+        }
+    }
+
+    /* Do prev-allocated bits and footers of free blocks match the headers? */
+    for (bp = heap_listp; bp != NULL; bp = walk_next(bp)) {
+        if (!GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))) != !GET_ALLOC(HDRP(bp))) {
+            fprintf(stderr, "prev-allocated bit out of sync");
+            return -1;
+        }
+        if (!GET_ALLOC(HDRP(bp)) && GET(FTRP(bp)) != PACK(GET_SIZE(HDRP(bp)), 0)) {
+            fprintf(stderr, "free block footer doesn't match its header");
+            return -1;
+        }
+    }
+
+    /* Is every free block actually in the free list */
+    int free_num0 = 0;
+    int free_num1 = 0;
+    for (bp = heap_listp; bp != NULL; bp = walk_next(bp)) {
+        if (!GET_ALLOC(HDRP(bp))) {
+            free_num0++;
+        }
+    }
+    for (int i = 0 ; i < ARENA_NUM ; i++) {
+        int n = arena_check(&arenas[i]);
+        if (n < 0)
+            return -1;
+        free_num1 += n;
+    }
+    if (free_num0 != free_num1) {
+        fprintf(stderr, "not every free block in the free list");
+        return -1;
+    }
+
     return 0;
-}
\ No newline at end of file
+}
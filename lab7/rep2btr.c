@@ -0,0 +1,99 @@
+/*
+ * rep2btr.c - Convert a text trace file (.rep) into a binary trace file
+ *             (.btr, see trace.h) that mdriver maps with no parsing.
+ *
+ * usage: rep2btr <file.rep> [<file.btr>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024 /* max string size */
+
+static void app_error(char *msg, char *path)
+{
+    fprintf(stderr, "rep2btr: %s %s\n", msg, path);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    trace_header_t hdr;
+    traceop_t *ops;
+    char outpath[MAXLINE];
+    char type[MAXLINE];
+    unsigned index, size;
+    int op_index = 0;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: rep2btr <file.rep> [<file.btr>]\n");
+        exit(1);
+    }
+    if (argc == 3) {
+        strncpy(outpath, argv[2], MAXLINE - 1);
+        outpath[MAXLINE - 1] = '\0';
+    }
+    else {
+        /* file.rep -> file.btr */
+        int len = strlen(argv[1]);
+        if (len < 4 || len > MAXLINE - 5 || strcmp(argv[1] + len - 4, ".rep"))
+            app_error("Need a .rep file name:", argv[1]);
+        strcpy(outpath, argv[1]);
+        strcpy(outpath + len - 4, ".btr");
+    }
+
+    /* Read the trace file header */
+    if ((in = fopen(argv[1], "r")) == NULL)
+        app_error("Could not open", argv[1]);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    if (fscanf(in, "%d %d %d %d", &hdr.sugg_heapsize, &hdr.num_ids,
+               &hdr.num_ops, &hdr.weight) != 4 ||
+        hdr.num_ops < 0 || hdr.num_ids < 0)
+        app_error("Bad header in", argv[1]);
+    if ((ops = (traceop_t *)malloc(hdr.num_ops * sizeof(traceop_t) + 1)) == NULL)
+        app_error("Out of memory for", argv[1]);
+
+    /* Read every request line in the trace file */
+    while (fscanf(in, "%s", type) != EOF) {
+        if (op_index == hdr.num_ops)
+            app_error("More requests than the header says in", argv[1]);
+        switch (type[0]) {
+            case 'a':
+            case 'r':
+                if (fscanf(in, "%u %u", &index, &size) != 2)
+                    app_error("Bad request in", argv[1]);
+                ops[op_index].type = type[0] == 'a' ? ALLOC : REALLOC;
+                ops[op_index].size = size;
+                break;
+            case 'f':
+                if (fscanf(in, "%u", &index) != 1)
+                    app_error("Bad request in", argv[1]);
+                ops[op_index].type = FREE;
+                ops[op_index].size = 0;
+                break;
+            default:
+                app_error("Bogus type character in", argv[1]);
+        }
+        if (index >= (unsigned)hdr.num_ids)
+            app_error("Request id out of range in", argv[1]);
+        ops[op_index].index = index;
+        op_index++;
+    }
+    fclose(in);
+    if (op_index != hdr.num_ops)
+        app_error("Fewer requests than the header says in", argv[1]);
+
+    /* Write the header and the packed requests */
+    if ((out = fopen(outpath, "wb")) == NULL)
+        app_error("Could not create", outpath);
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+        fwrite(ops, sizeof(traceop_t), hdr.num_ops, out) != (size_t)hdr.num_ops ||
+        fclose(out) != 0)
+        app_error("Could not write", outpath);
+    free(ops);
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * trace.h - Trace requests and the binary trace file format
+ *
+ * A binary trace file (.btr) holds the same requests as a text trace
+ * file (.rep), already parsed, so mdriver can mmap it instead of
+ * scanning it:
+ *
+ *   trace_header_t
+ *   num_ops x traceop_t
+ *
+ * All fields are in the byte order of the machine that wrote the file.
+ * Use rep2btr to convert a .rep file.
+ */
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stdint.h>
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc request */
+} traceop_t;
+
+#define TRACE_MAGIC 0x31525442  /* "BTR1" */
+
+/* Header of a binary trace file, the same fields as a .rep header */
+typedef struct {
+    uint32_t magic;         /* TRACE_MAGIC */
+    int32_t sugg_heapsize;  /* suggested heap size (unused) */
+    int32_t num_ids;        /* number of alloc/realloc ids */
+    int32_t num_ops;        /* number of distinct requests */
+    int32_t weight;         /* weight for this trace (unused) */
+} trace_header_t;
+
+#endif /* __TRACE_H_ */